@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "Servant.h"
+
+// hold at most <size> bytes of file contents
+Cache::Cache(long long size):capacity(size/CACHE_SHARDS),shards(new shard[CACHE_SHARDS]),hits(0),misses(0),evictions(0){
+	for(int i=0;i<CACHE_SHARDS;++i)
+		shards[i].bytes=0;
+}
+
+// the cached contents of file <canon>, if it's still <size> bytes long and last modified at <modified>
+// and none of its includes have changed either (unless <check_includes> is false, when something else keeps track of them)
+// returns NULL if it isn't cached, has changed since, or was cached as something other than <type> in <encoding>
+std::shared_ptr<const cached_file> Cache::find(const std::string &canon,long long size,long long modified,const char *type,int encoding,bool check_includes){
+	std::shared_ptr<const cached_file> entry;
+	{
+		shard &s=pick(canon);
+		std::lock_guard<std::mutex> guard(s.lock);
+
+		auto it=s.index.find(canon);
+		if(it==s.index.end()){
+			misses.fetch_add(1,std::memory_order_relaxed);
+			return NULL;
+		}
+
+		entry=it->second->second;
+		if(entry->size!=size||entry->mtime!=modified||entry->encoding!=encoding||strcmp(entry->type,type)){
+			evict(s,it->second);
+			misses.fetch_add(1,std::memory_order_relaxed);
+			return NULL;
+		}
+
+		// move to the front
+		s.lru.splice(s.lru.begin(),s.lru,it->second);
+	}
+
+	// check the includes without holding up the rest of the shard
+	if(check_includes){
+		for(const cached_source &source:entry->includes){
+			long long now_size,now_modified;
+			if(!file_stamp(source.name,now_size,now_modified)||now_size!=source.size||now_modified!=source.mtime){
+				erase(canon);
+				misses.fetch_add(1,std::memory_order_relaxed);
+				return NULL;
+			}
+		}
+	}
+
+	hits.fetch_add(1,std::memory_order_relaxed);
+	return entry;
+}
+
+// cache <entry> as the contents of <canon>, pushing out the least recently used files to make room
+// files too big for their shard aren't cached
+void Cache::insert(const std::string &canon,const std::shared_ptr<const cached_file> &entry){
+	const long long size=entry->response.length();
+	if(size>capacity)
+		return;
+
+	shard &s=pick(canon);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	// someone else may have read it at the same time
+	auto it=s.index.find(canon);
+	if(it!=s.index.end())
+		evict(s,it->second);
+
+	while(s.bytes+size>capacity){
+		evict(s,std::prev(s.lru.end()));
+		evictions.fetch_add(1,std::memory_order_relaxed);
+	}
+
+	s.lru.emplace_front(canon,entry);
+	s.index[canon]=s.lru.begin();
+	s.bytes+=size;
+}
+
+// forget about <canon>
+void Cache::erase(const std::string &canon){
+	shard &s=pick(canon);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	auto it=s.index.find(canon);
+	if(it!=s.index.end())
+		evict(s,it->second);
+}
+
+// forget every file <stale> is true for, given its canonical path and entry
+void Cache::erase_if(const std::function<bool(const std::string&,const cached_file&)> &stale){
+	for(int i=0;i<CACHE_SHARDS;++i){
+		std::lock_guard<std::mutex> guard(shards[i].lock);
+
+		for(auto it=shards[i].lru.begin();it!=shards[i].lru.end();){
+			auto next=std::next(it);
+			if(stale(it->first,*it->second))
+				evict(shards[i],it);
+			it=next;
+		}
+	}
+}
+
+cache_counts Cache::counts(){
+	cache_counts c;
+	c.hits=hits.load(std::memory_order_relaxed);
+	c.misses=misses.load(std::memory_order_relaxed);
+	c.evictions=evictions.load(std::memory_order_relaxed);
+	c.bytes=0;
+	c.files=0;
+
+	for(int i=0;i<CACHE_SHARDS;++i){
+		std::lock_guard<std::mutex> guard(shards[i].lock);
+		c.bytes+=shards[i].bytes;
+		c.files+=shards[i].lru.size();
+	}
+
+	return c;
+}
+
+Cache::shard &Cache::pick(const std::string &canon){
+	return shards[std::hash<std::string>()(canon)%CACHE_SHARDS];
+}
+
+// drop <it> from shard <s>, which must be locked
+void Cache::evict(shard &s,lru_list::iterator it){
+	s.bytes-=it->second->response.length();
+	s.index.erase(it->first);
+	s.lru.erase(it);
+}
+
+// the canonical path <target> resolved to last time, in <canon>
+// returns false if it hasn't been resolved yet (on this thread)
+bool PathCache::find(const std::string &target,std::string &canon){
+	local &l=mine();
+
+	auto it=l.paths.find(target);
+	if(it==l.paths.end())
+		return false;
+
+	canon=it->second;
+	return true;
+}
+
+// remember that <target> resolves to <canon>
+void PathCache::insert(const std::string &target,const std::string &canon){
+	local &l=mine();
+
+	if(l.paths.size()>=PATH_CACHE_MAX)
+		l.paths.clear();
+
+	l.paths[target]=canon;
+}
+
+// forget what <target> resolved to, for when it doesn't anymore
+// other threads find that out for themselves
+void PathCache::erase(const std::string &target){
+	mine().paths.erase(target);
+}
+
+// forget everything, on every thread, for when files have moved around
+void PathCache::clear(){
+	generation.fetch_add(1,std::memory_order_release);
+}
+
+// the calling thread's paths, emptied first if they're from before the last PathCache::clear
+PathCache::local &PathCache::mine(){
+	thread_local local l={NULL,0};
+
+	const unsigned now=generation.load(std::memory_order_acquire);
+	if(l.owner!=this||l.generation!=now){
+		l.paths.clear();
+		l.owner=this;
+		l.generation=now;
+	}
+
+	return l;
+}
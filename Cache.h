@@ -0,0 +1,106 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <functional>
+
+#define CACHE_SHARDS 16 // separately locked parts of the cache, paths are spread across them by hash
+#define CACHE_MAX_FILE (1<<20) // bigger files aren't cached, they're sent from the page cache
+#define DEFAULT_CACHE_SIZE (64<<20) // bytes of file contents kept in memory
+#define PATH_CACHE_MAX 16384 // paths remembered per thread, a thread that's full starts over
+
+// a file something was built from, as it was at the time
+struct cached_source{
+	std::string name;
+	long long size;
+	long long mtime;
+};
+
+// a cached file's contents and what's known about it, never changes once it's cached
+struct cached_file{
+	std::string response; // the whole 200 response, header and then the file's contents (rendered, for html files)
+	unsigned header_length; // where the contents start in <response>
+	long long size; // of the file when it was read
+	long long mtime; // modification time of the file when it was read
+	const char *type; // content type
+	int encoding; // content coding, ENCODING_* or 0
+	std::vector<cached_source> includes; // files pulled in by server side includes, all the way down
+};
+
+// how the cache has done so far, see Cache::counts
+struct cache_counts{
+	unsigned long long hits;
+	unsigned long long misses; // including files found to have changed
+	unsigned long long evictions; // files pushed out to make room
+	unsigned long long bytes; // held right now
+	unsigned long long files;
+};
+
+// size bounded least recently used cache of whole files by canonical path, safe to use from any thread
+// a file is cached one way at a time, it takes its type and encoding from how it was asked for ("style.css.gz" can be a file of its own or a variant of "style.css")
+// html files are cached rendered, and go stale when they or anything they include changes
+// entries are shared, a file evicted or replaced while it's being sent lives on until the send is done
+class Cache{
+public:
+	Cache(long long);
+	Cache(const Cache&)=delete;
+	Cache(Cache&&)=delete;
+	Cache &operator=(const Cache&)=delete;
+	std::shared_ptr<const cached_file> find(const std::string&,long long,long long,const char*,int,bool = true);
+	void insert(const std::string&,const std::shared_ptr<const cached_file>&);
+	void erase(const std::string&);
+	void erase_if(const std::function<bool(const std::string&,const cached_file&)>&);
+	cache_counts counts();
+
+private:
+	typedef std::list<std::pair<std::string,std::shared_ptr<const cached_file>>> lru_list;
+
+	struct shard{
+		std::mutex lock; // protects the rest
+		lru_list lru; // most recently used first
+		std::unordered_map<std::string,lru_list::iterator> index;
+		long long bytes;
+	};
+
+	shard &pick(const std::string&);
+	void evict(shard&,lru_list::iterator);
+
+	const long long capacity; // per shard
+	std::unique_ptr<shard[]> shards;
+	std::atomic<unsigned long long> hits;
+	std::atomic<unsigned long long> misses;
+	std::atomic<unsigned long long> evictions;
+};
+
+// which canonical path each requested path resolved to, safe to use from any thread
+// every thread remembers paths on its own, so lookups don't touch anything other threads write
+// (PathCache::clear is the exception, and it's rare)
+class PathCache{
+public:
+	PathCache():generation(0){}
+	PathCache(const PathCache&)=delete;
+	PathCache &operator=(const PathCache&)=delete;
+	bool find(const std::string&,std::string&);
+	void insert(const std::string&,const std::string&);
+	void erase(const std::string&);
+	void clear();
+
+private:
+	struct local{
+		const PathCache *owner; // whose paths these are
+		unsigned generation; // <owner>'s <generation> when they were remembered
+		std::unordered_map<std::string,std::string> paths;
+	};
+
+	local &mine();
+
+	std::atomic<unsigned> generation; // bumped by PathCache::clear
+};
+
+#endif // CACHE_H
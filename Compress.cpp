@@ -0,0 +1,71 @@
+#include "Servant.h"
+
+#ifdef SERVANT_GZIP
+#include <zlib.h>
+#endif // SERVANT_GZIP
+#ifdef SERVANT_BROTLI
+#include <brotli/encode.h>
+#endif // SERVANT_BROTLI
+
+// the name of <encoding> (ENCODING_*) in Content-Encoding and Accept-Encoding
+const char *encoding_name(int encoding){
+	return encoding==ENCODING_BROTLI?"br":"gzip";
+}
+
+// what's appended to a file's name for its <encoding> variant
+const char *encoding_extension(int encoding){
+	return encoding==ENCODING_BROTLI?".br":".gz";
+}
+
+// the encodings compress can do, depends on what servant was built with
+int compressors(){
+	int available=0;
+#ifdef SERVANT_GZIP
+	available|=ENCODING_GZIP;
+#endif // SERVANT_GZIP
+#ifdef SERVANT_BROTLI
+	available|=ENCODING_BROTLI;
+#endif // SERVANT_BROTLI
+
+	return available;
+}
+
+// compress <in> as hard as <encoding> goes into <out>, it's done once per file so time doesn't matter much
+bool compress(int encoding,const std::string &in,std::string &out){
+#ifdef SERVANT_GZIP
+	if(encoding==ENCODING_GZIP){
+		z_stream z={};
+		// 15 window bits, +16 for a gzip wrapper instead of zlib's
+		if(deflateInit2(&z,Z_BEST_COMPRESSION,Z_DEFLATED,15+16,9,Z_DEFAULT_STRATEGY)!=Z_OK)
+			return false;
+
+		out.resize(deflateBound(&z,in.length()));
+		z.next_in=(Bytef*)in.data();
+		z.avail_in=in.length();
+		z.next_out=(Bytef*)&out[0];
+		z.avail_out=out.length();
+
+		const int result=deflate(&z,Z_FINISH);
+		out.resize(z.total_out);
+		deflateEnd(&z);
+
+		return result==Z_STREAM_END;
+	}
+#endif // SERVANT_GZIP
+#ifdef SERVANT_BROTLI
+	if(encoding==ENCODING_BROTLI){
+		size_t size=BrotliEncoderMaxCompressedSize(in.length());
+		if(size==0)
+			return false;
+
+		out.resize(size);
+		if(!BrotliEncoderCompress(BROTLI_MAX_QUALITY,BROTLI_DEFAULT_WINDOW,BROTLI_MODE_TEXT,in.length(),(const uint8_t*)in.data(),&size,(uint8_t*)&out[0]))
+			return false;
+
+		out.resize(size);
+		return true;
+	}
+#endif // SERVANT_BROTLI
+
+	return false;
+}
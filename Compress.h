@@ -0,0 +1,15 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <string>
+
+// content codings, as bits so a client can accept several
+#define ENCODING_GZIP 1
+#define ENCODING_BROTLI 2
+
+const char *encoding_name(int);
+const char *encoding_extension(int);
+int compressors();
+bool compress(int,const std::string&,std::string&);
+
+#endif // COMPRESS_H
@@ -0,0 +1,38 @@
+#include <algorithm>
+
+#include "Servant.h"
+
+Index::Index(std::vector<indexed_file> &&found):files(std::move(found)){
+	std::sort(files.begin(),files.end(),[](const indexed_file &a,const indexed_file &b){
+		return a.path<b.path;
+	});
+}
+
+// the file requested as <path>, NULL if it isn't in the index
+const indexed_file *Index::find(const std::string &path)const{
+	auto it=std::lower_bound(files.begin(),files.end(),path,[](const indexed_file &f,const std::string &p){
+		return f.path<p;
+	});
+
+	if(it==files.end()||it->path!=path)
+		return NULL;
+
+	return &*it;
+}
+
+// a copy of the index with the sizes and modification times of files <names> (relative to the document root) looked up again
+// for when files have only been written to, the paths in it still hold
+std::shared_ptr<const Index> Index::restamp(const std::unordered_set<std::string> &names)const{
+	std::vector<indexed_file> copy=files;
+	for(indexed_file &f:copy){
+		if(names.count(f.name))
+			file_stamp(f.canon,f.size,f.mtime);
+	}
+
+	return std::shared_ptr<const Index>(new Index(std::move(copy)));
+}
+
+// paths in the index, directories count once for each way of asking for them
+unsigned Index::size()const{
+	return files.size();
+}
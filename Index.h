@@ -0,0 +1,34 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_set>
+
+// what the index knows about a file, as of when the index was built
+struct indexed_file{
+	std::string path; // as requested, without leading slashes ("about" and "about/" for about/index.html)
+	std::string name; // the file, relative to the document root
+	std::string canon; // canonical path
+	long long size; // size and modification time are only kept up to date while the document root is watched
+	long long mtime;
+	const char *type; // content type
+};
+
+// every servable file under the document root, sorted by requested path
+// never changes once it's built, so any number of threads can look things up in it at once
+class Index{
+public:
+	Index(std::vector<indexed_file>&&);
+	Index(const Index&)=delete;
+	Index &operator=(const Index&)=delete;
+	const indexed_file *find(const std::string&)const;
+	std::shared_ptr<const Index> restamp(const std::unordered_set<std::string>&)const;
+	unsigned size()const;
+
+private:
+	std::vector<indexed_file> files;
+};
+
+#endif // INDEX_H
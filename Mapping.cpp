@@ -0,0 +1,81 @@
+#include "Servant.h"
+
+std::mutex Mapping::lock;
+std::unordered_map<std::string,std::weak_ptr<const Mapping>> Mapping::mappings;
+size_t Mapping::prune_at=MAPPING_PRUNE;
+
+Mapping::Mapping(const char *data,int file,long long size,long long modified):map(data),fd(file),map_size(size),mtime(modified){}
+
+Mapping::~Mapping(){
+	if(map!=NULL)
+		unmap_file(map,map_size);
+	if(fd!=-1)
+		close_file(fd);
+}
+
+// the mapping for the file at canonical path <canon>, <size> bytes long and last modified at <modified>
+// a file that changed gets a new mapping, the old one lives on until the last session using it lets go
+// returns NULL if the file couldn't be mapped, or isn't at <canon> anymore (see open_canonical)
+std::shared_ptr<const Mapping> Mapping::get(const std::string &canon,long long size,long long modified){
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		std::shared_ptr<const Mapping> existing=mappings[canon].lock();
+		if(existing&&existing->map_size==size&&existing->mtime==modified)
+			return existing;
+	}
+
+	// mapping it doesn't hold up everyone else
+	// empty files can't be mapped, but there's nothing to read anyway
+	const char *data=NULL;
+	int fd=-1;
+	if(size>0){
+		fd=open_canonical(canon);
+		if(fd==-1)
+			return NULL;
+
+		data=map_file(fd,size);
+		if(data==NULL){
+			close_file(fd);
+			return NULL;
+		}
+	}
+	std::shared_ptr<const Mapping> mapping(new Mapping(data,fd,size,modified));
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	// someone else may have mapped it at the same time
+	std::weak_ptr<const Mapping> &slot=mappings[canon];
+	std::shared_ptr<const Mapping> existing=slot.lock();
+	if(existing&&existing->map_size==size&&existing->mtime==modified)
+		return existing;
+	slot=mapping;
+
+	// forget about files nobody is using anymore once there are enough of them
+	if(mappings.size()>=prune_at){
+		for(auto it=mappings.begin();it!=mappings.end();){
+			if(it->second.expired())
+				it=mappings.erase(it);
+			else
+				++it;
+		}
+
+		prune_at=mappings.size()*2>MAPPING_PRUNE?mappings.size()*2:MAPPING_PRUNE;
+	}
+
+	return mapping;
+}
+
+// the file's contents, NULL if it's empty
+const char *Mapping::data()const{
+	return map;
+}
+
+long long Mapping::size()const{
+	return map_size;
+}
+
+// the open file, -1 for empty files
+int Mapping::file()const{
+	return fd;
+}
@@ -0,0 +1,38 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#define MAPPING_PRUNE 64 // files tracked before unused ones are forgotten
+
+// a read only memory mapping of a whole file
+// everyone serving the same file at the same time shares one mapping, see Mapping::get
+// only the kernel should read <map> (sending it), if someone cuts the file short a read out here is a SIGBUS. use <fd> instead
+class Mapping{
+public:
+	Mapping(const Mapping&)=delete;
+	Mapping(Mapping&&)=delete;
+	~Mapping();
+	Mapping &operator=(const Mapping&)=delete;
+	static std::shared_ptr<const Mapping> get(const std::string&,long long,long long);
+	const char *data()const;
+	long long size()const;
+	int file()const;
+
+private:
+	Mapping(const char*,int,long long,long long);
+
+	const char *const map;
+	const int fd; // the file, kept open for reading it without touching <map>, -1 for empty files
+	const long long map_size;
+	const long long mtime; // modification time of the file when it was mapped
+
+	static std::mutex lock; // protects <mappings>
+	static std::unordered_map<std::string,std::weak_ptr<const Mapping>> mappings; // live mappings by canonical path
+	static size_t prune_at; // size of <mappings> that triggers forgetting the unused ones
+};
+
+#endif // MAPPING_H
@@ -0,0 +1,250 @@
+#include "Reactor.h"
+
+#ifndef _WIN32
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#endif // _WIN32
+
+#ifdef _WIN32
+static short to_poll(int events){
+	short result=0;
+	if(events&REACTOR_READ)
+		result|=POLLRDNORM;
+	if(events&REACTOR_WRITE)
+		result|=POLLWRNORM;
+
+	return result;
+}
+#else
+static unsigned to_epoll(int events){
+	unsigned result=EPOLLET|EPOLLRDHUP;
+	if(events&REACTOR_READ)
+		result|=EPOLLIN;
+	if(events&REACTOR_WRITE)
+		result|=EPOLLOUT;
+
+	return result;
+}
+#endif // _WIN32
+
+Reactor::Reactor(){
+#ifndef _WIN32
+	epfd=epoll_create1(EPOLL_CLOEXEC);
+#endif // _WIN32
+	init_wake();
+}
+
+Reactor::~Reactor(){
+#ifdef _WIN32
+	if(wakefd!=-1)
+		closesocket(wakefd);
+#else
+	if(wakefd!=-1)
+		close(wakefd);
+	if(epfd!=-1)
+		close(epfd);
+#endif // _WIN32
+}
+
+bool Reactor::operator!()const{
+#ifdef _WIN32
+	return wakefd==-1;
+#else
+	return epfd==-1||wakefd==-1;
+#endif // _WIN32
+}
+
+// start watching <fd> for <events>, <ptr> is handed back by Reactor::wait
+bool Reactor::add(int fd,int events,void *ptr){
+#ifdef _WIN32
+	WSAPOLLFD pfd;
+	pfd.fd=fd;
+	pfd.events=to_poll(events);
+	pfd.revents=0;
+
+	fds.push_back(pfd);
+	data.push_back(ptr);
+	return true;
+#else
+	epoll_event ev;
+	ev.events=to_epoll(events);
+	ev.data.ptr=ptr;
+
+	return epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)==0;
+#endif // _WIN32
+}
+
+// change the events <fd> is watched for
+bool Reactor::modify(int fd,int events,void *ptr){
+#ifdef _WIN32
+	for(unsigned i=0;i<fds.size();++i){
+		if(fds[i].fd==(SOCKET)fd){
+			fds[i].events=to_poll(events);
+			data[i]=ptr;
+			return true;
+		}
+	}
+
+	return false;
+#else
+	epoll_event ev;
+	ev.events=to_epoll(events);
+	ev.data.ptr=ptr;
+
+	return epoll_ctl(epfd,EPOLL_CTL_MOD,fd,&ev)==0;
+#endif // _WIN32
+}
+
+// stop watching <fd>, must be called before <fd> is closed
+void Reactor::remove(int fd){
+#ifdef _WIN32
+	for(unsigned i=0;i<fds.size();++i){
+		if(fds[i].fd==(SOCKET)fd){
+			fds.erase(fds.begin()+i);
+			data.erase(data.begin()+i);
+			return;
+		}
+	}
+#else
+	epoll_event ev; // ignored, but required by older kernels
+	epoll_ctl(epfd,EPOLL_CTL_DEL,fd,&ev);
+#endif // _WIN32
+}
+
+// wait up to <millis> milliseconds for readiness, fills at most <max> entries in <events>
+// returns number of entries filled, returns early if Reactor::wake is called
+int Reactor::wait(reactor_event *events,int max,int millis){
+#ifdef _WIN32
+	if(fds.empty()){
+		Sleep(millis);
+		return 0;
+	}
+
+	if(WSAPoll(&fds[0],fds.size(),millis)<1)
+		return 0;
+
+	int count=0;
+	for(unsigned i=0;i<fds.size()&&count<max;++i){
+		const short revents=fds[i].revents;
+		if(revents==0)
+			continue;
+
+		if(fds[i].fd==(SOCKET)wakefd){
+			drain_wake();
+			continue;
+		}
+
+		events[count].data=data[i];
+		events[count].events=0;
+		if(revents&POLLRDNORM)
+			events[count].events|=REACTOR_READ;
+		if(revents&POLLWRNORM)
+			events[count].events|=REACTOR_WRITE;
+		if(revents&(POLLHUP|POLLERR))
+			events[count].events|=REACTOR_HANGUP;
+		++count;
+	}
+
+	return count;
+#else
+	const int max_events=64;
+	epoll_event ready[max_events];
+
+	const int got=epoll_wait(epfd,ready,max<max_events?max:max_events,millis);
+	if(got<1)
+		return 0;
+
+	int count=0;
+	for(int i=0;i<got;++i){
+		if(ready[i].data.ptr==&wakefd){
+			drain_wake();
+			continue;
+		}
+
+		events[count].data=ready[i].data.ptr;
+		events[count].events=0;
+		if(ready[i].events&EPOLLIN)
+			events[count].events|=REACTOR_READ;
+		if(ready[i].events&EPOLLOUT)
+			events[count].events|=REACTOR_WRITE;
+		if(ready[i].events&(EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+			events[count].events|=REACTOR_HANGUP;
+		++count;
+	}
+
+	return count;
+#endif // _WIN32
+}
+
+// interrupt Reactor::wait, safe to call from any thread
+void Reactor::wake(){
+	if(wakefd==-1)
+		return;
+
+#ifdef _WIN32
+	const char b=0;
+	::send(wakefd,&b,1,0);
+#else
+	const uint64_t one=1;
+	if(write(wakefd,&one,sizeof(one))){}
+#endif // _WIN32
+}
+
+// something that becomes readable when Reactor::wait has events, -1 if there isn't one
+int Reactor::get_fd()const{
+#ifdef _WIN32
+	return -1;
+#else
+	return epfd;
+#endif // _WIN32
+}
+
+// set up <wakefd> and start watching it
+void Reactor::init_wake(){
+#ifdef _WIN32
+	// windows can only poll sockets, so use a udp socket connected to itself
+	wakefd=socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+	if(wakefd==-1)
+		return;
+
+	sockaddr_in addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	int len=sizeof(addr);
+	u_long nonblock=1;
+	if(::bind(wakefd,(sockaddr*)&addr,len)||getsockname(wakefd,(sockaddr*)&addr,&len)||::connect(wakefd,(sockaddr*)&addr,len)||ioctlsocket(wakefd,FIONBIO,&nonblock)){
+		closesocket(wakefd);
+		wakefd=-1;
+		return;
+	}
+
+	add(wakefd,REACTOR_READ,&wakefd);
+#else
+	wakefd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if(wakefd==-1)
+		return;
+
+	epoll_event ev;
+	ev.events=EPOLLIN|EPOLLET;
+	ev.data.ptr=&wakefd;
+	if(epoll_ctl(epfd,EPOLL_CTL_ADD,wakefd,&ev)){
+		close(wakefd);
+		wakefd=-1;
+	}
+#endif // _WIN32
+}
+
+// reset <wakefd> so it can signal again
+void Reactor::drain_wake(){
+#ifdef _WIN32
+	char b[16];
+	while(::recv(wakefd,b,sizeof(b),0)>0);
+#else
+	uint64_t count;
+	if(read(wakefd,&count,sizeof(count))){}
+#endif // _WIN32
+}
@@ -0,0 +1,51 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif // _WIN32
+
+// readiness events reported by Reactor::wait
+#define REACTOR_READ 1
+#define REACTOR_WRITE 2
+#define REACTOR_HANGUP 4 // peer hung up or the socket errored
+
+struct reactor_event{
+	void *data; // whatever was passed to Reactor::add
+	int events; // REACTOR_* flags
+};
+
+// edge triggered readiness notification for sockets
+// users are expected to drain a socket (read or write until it would block) every time it is reported
+class Reactor{
+public:
+	Reactor();
+	Reactor(const Reactor&)=delete;
+	Reactor(Reactor&&)=delete;
+	~Reactor();
+	Reactor &operator=(const Reactor&)=delete;
+	bool operator!()const;
+	bool add(int,int,void*);
+	bool modify(int,int,void*);
+	void remove(int);
+	int wait(reactor_event*,int,int);
+	void wake();
+	int get_fd()const;
+
+private:
+	void init_wake();
+	void drain_wake();
+
+#ifdef _WIN32
+	// no epoll on windows, fall back to level triggered WSAPoll
+	std::vector<WSAPOLLFD> fds;
+	std::vector<void*> data;
+#else
+	int epfd;
+#endif // _WIN32
+	int wakefd; // becomes readable when Reactor::wake is called
+};
+
+#endif // REACTOR_H
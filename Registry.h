@@ -0,0 +1,135 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+
+#define REGISTRY_PAGE 256 // entries allocated at a time
+#define REGISTRY_INDEX_BITS 20 // low bits of a key, the rest is the generation
+#define REGISTRY_CAPACITY (1u<<REGISTRY_INDEX_BITS)
+
+// slab of entries addressed by key, everything is O(1)
+// a key is the entry's index plus a generation count, so a key for an entry that has since been erased
+// doesn't find whatever took its place. keys are never 0
+// entries never move, pointers to them stay good until they're erased
+// live entries are kept on an intrusive list for walking with Registry::first and Registry::next
+// only Registry::size may be called from other threads
+template<typename T> class Registry{
+public:
+	Registry():head(NULL),live(0){}
+	Registry(const Registry&)=delete;
+	Registry &operator=(const Registry&)=delete;
+
+	// store <value>, returns its key, or 0 if full
+	unsigned insert(T &&value){
+		if(free_nodes.empty()){
+			if(pages.size()*REGISTRY_PAGE>=REGISTRY_CAPACITY)
+				return 0;
+
+			const unsigned base=pages.size()*REGISTRY_PAGE;
+			pages.emplace_back(new node[REGISTRY_PAGE]);
+			for(unsigned i=REGISTRY_PAGE;i>0;--i){
+				node &n=pages.back()[i-1];
+				n.index=base+i-1;
+				n.generation=0;
+				n.used=false;
+				free_nodes.push_back(&n);
+			}
+		}
+
+		node *n=free_nodes.back();
+		free_nodes.pop_back();
+
+		n->value=std::move(value);
+		n->used=true;
+		// skip 0, so keys never are
+		n->generation=(n->generation+1)&((1u<<(32-REGISTRY_INDEX_BITS))-1);
+		if(n->generation==0)
+			n->generation=1;
+
+		// link it at the front
+		n->prev=NULL;
+		n->next=head;
+		if(head!=NULL)
+			head->prev=n;
+		head=n;
+
+		live.fetch_add(1,std::memory_order_relaxed);
+		return key(n);
+	}
+
+	// the entry for <k>, NULL if it's gone
+	T *find(unsigned k){
+		node *n=lookup(k);
+		return n==NULL?NULL:&n->value;
+	}
+
+	// get rid of the entry for <k>
+	void erase(unsigned k){
+		node *n=lookup(k);
+		if(n==NULL)
+			return;
+
+		if(n->prev!=NULL)
+			n->prev->next=n->next;
+		else
+			head=n->next;
+		if(n->next!=NULL)
+			n->next->prev=n->prev;
+
+		n->value=T();
+		n->used=false;
+		free_nodes.push_back(n);
+
+		live.fetch_sub(1,std::memory_order_relaxed);
+	}
+
+	// walk the live entries, 0 when there are no more
+	// get the next key before erasing the current one
+	unsigned first()const{
+		return head==NULL?0:key(head);
+	}
+	unsigned next(unsigned k)const{
+		const node *n=&pages[(k&(REGISTRY_CAPACITY-1))/REGISTRY_PAGE][k%REGISTRY_PAGE];
+		return n->next==NULL?0:key(n->next);
+	}
+
+	// number of live entries
+	unsigned size()const{
+		return live.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct node{
+		T value;
+		unsigned index;
+		unsigned generation;
+		bool used;
+		node *prev;
+		node *next;
+	};
+
+	unsigned key(const node *n)const{
+		return (n->generation<<REGISTRY_INDEX_BITS)|n->index;
+	}
+
+	node *lookup(unsigned k){
+		const unsigned index=k&(REGISTRY_CAPACITY-1);
+		if(index>=pages.size()*REGISTRY_PAGE)
+			return NULL;
+
+		node *n=&pages[index/REGISTRY_PAGE][index%REGISTRY_PAGE];
+		if(!n->used||n->generation!=k>>REGISTRY_INDEX_BITS)
+			return NULL;
+
+		return n;
+	}
+
+	std::vector<std::unique_ptr<node[]>> pages;
+	std::vector<node*> free_nodes;
+	node *head; // most recently inserted live entry
+	std::atomic<unsigned> live;
+};
+
+#endif // REGISTRY_H
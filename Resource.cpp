@@ -1,13 +1,28 @@
 #include <string.h>
 #include <ctype.h>
 #include <algorithm>
+#include <unordered_set>
 
 #include "Servant.h"
 
+extern std::atomic<bool> running;
+
 #undef min
 #undef max
 
-Resource::Resource(const std::string &target){
+bool Resource::mapped=false;
+int Resource::stream_policy=STREAM_SEQUENTIAL;
+long long Resource::stream_size=DEFAULT_STREAM_SIZE;
+std::atomic<unsigned long long> Resource::stream_files_count(0);
+std::atomic<unsigned long long> Resource::stream_readahead(0);
+std::atomic<unsigned long long> Resource::stream_dropped(0);
+std::unique_ptr<Cache> Resource::cache;
+std::string Resource::root;
+PathCache Resource::paths;
+std::atomic<std::shared_ptr<const Index>> Resource::index;
+bool Resource::watching=false;
+
+Resource::Resource(const std::string &target):rsrc(-1),offset(0),content_encoding(0),streaming(false),ahead(0),behind(0){
 	fname=target;
 
 	// if fname is root ("/"), then replace with current dir
@@ -20,23 +35,61 @@ Resource::Resource(const std::string &target){
 			fname.erase(fname.begin());
 	}catch(const std::out_of_range &e){}
 
+	// files that were there when the document root was indexed are already known to be fine
+	const std::shared_ptr<const Index> files=index.load();
+	const indexed_file *indexed=files?files->find(fname):NULL;
+	if(indexed!=NULL){
+		fname=indexed->name;
+		content_type=indexed->type;
+		if(init_file(indexed->canon,indexed))
+			return;
+
+		// it isn't where the index says anymore, look for it
+	}
+
 	// append /index.html if fname is a direcory
 	if(is_directory(fname))
 		fname+=(fname.at(fname.length()-1)=='/')?"index.html":"/index.html";
 
 	// checks for ../ tomfoolery, also checks if file exists
-	Resource::check_valid(fname);
+	std::string canon;
+	Resource::check_valid(fname,canon);
 
 	// figure out the content type
 	content_type=Resource::get_type(fname);
 
-	init_file();
+	if(!init_file(canon)){
+		// paths are only checked the first time, it may go through a symlink by now
+		paths.erase(fname);
+		Resource::check_valid(fname,canon);
+		if(!init_file(canon))
+			throw SessionErrorNotFound(fname);
+	}
+}
+
+// the <encoding> (ENCODING_*) variant <name> (canonical path <canon>) of a file of type <type>, see Resource::encoded
+Resource::Resource(const std::string &name,const std::string &canon,const char *type,int encoding,const indexed_file *indexed):fname(name),rsrc(-1),offset(0),content_type(type),content_encoding(encoding),streaming(false),ahead(0),behind(0){
+	if(!init_file(canon,indexed))
+		throw SessionErrorNotFound(fname);
 }
 
 // move constructor, leaves original unusable
-Resource::Resource(Resource &&rhs):fname(std::move(rhs.fname)),rsrc(std::move(rhs.rsrc)){
+Resource::Resource(Resource &&rhs):fname(std::move(rhs.fname)),html_file(std::move(rhs.html_file)),rsrc(rhs.rsrc),map(std::move(rhs.map)),contents(std::move(rhs.contents)),source(std::move(rhs.source)),includes(std::move(rhs.includes)),offset(rhs.offset),streaming(rhs.streaming),ahead(rhs.ahead),behind(rhs.behind){
 	fsize=rhs.fsize;
 	content_type=rhs.content_type;
+	content_encoding=rhs.content_encoding;
+
+	rhs.rsrc=-1;
+}
+
+Resource::~Resource(){
+	if(rsrc!=-1)
+		close_file(rsrc);
+}
+
+// the whole 200 response for the resource, ready to send, if it came from the cache (NULL otherwise)
+const std::string *Resource::response()const{
+	return contents?&contents->response:NULL;
 }
 
 // file name
@@ -47,7 +100,29 @@ const std::string &Resource::name()const{
 // retrieve a chunk of size <size>, advances the internal stream pointer
 // returns bytes read
 int Resource::get(char *buf,int size){
-	if(!strcmp(content_type,"text/html")){
+	if(contents){
+		const int retrieve=std::min((long long)size,fsize-offset);
+		if(retrieve<1)
+			return 0;
+
+		memcpy(buf,data()+offset,retrieve);
+		offset+=retrieve;
+		return retrieve;
+	}
+	else if(map){
+		// read, not copied out of the mapping (see Mapping)
+		const int retrieve=std::min((long long)size,fsize-offset);
+		if(retrieve<1)
+			return 0;
+
+		const int got=read_file(map->file(),buf,retrieve,offset);
+		if(got<1)
+			return 0;
+
+		offset+=got;
+		return got;
+	}
+	else if(!strcmp(content_type,"text/html")){
 		const int max=html_file.length();
 		const int retrieve=std::min(max,size);
 		memcpy(buf,html_file.c_str(),retrieve);
@@ -57,8 +132,12 @@ int Resource::get(char *buf,int size){
 		return retrieve;
 	}
 	else{
-		rsrc.read(buf,size);
-		return rsrc.gcount();
+		const int got=read_file(rsrc,buf,size,offset);
+		if(got<1)
+			return 0;
+
+		offset+=got;
+		return got;
 	}
 }
 
@@ -70,53 +149,500 @@ const char *Resource::type()const{
 	return content_type;
 }
 
-// if the resource is html file, process it for server side includes
-// otherwise just open the stream
-void Resource::init_file(){
-	// html files are processed differently
-	if(!strcmp(content_type,"text/html")){
-		const int len = filesize(fname);
-		if(len == -1)
-			throw SessionErrorInternal("could not stat file \"" + fname + "\"");
+// the content coding the resource is in, NULL if it's the file as it is
+const char *Resource::encoding()const{
+	return content_encoding==0?NULL:encoding_name(content_encoding);
+}
+
+// header fields that go with the resource in every response for it
+const char *Resource::headers()const{
+	if(content_encoding==ENCODING_GZIP)
+		return "Accept-Ranges: bytes\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+	else if(content_encoding==ENCODING_BROTLI)
+		return "Accept-Ranges: bytes\r\nContent-Encoding: br\r\nVary: Accept-Encoding\r\n";
+	else if(compressible(content_type))
+		return "Accept-Ranges: bytes\r\nVary: Accept-Encoding\r\n";
+	else
+		return "Accept-Ranges: bytes\r\n";
+}
+
+// the open file for reading the resource directly (at any offset), -1 if the resource is in memory
+// mapped files have one too, for anything that would otherwise have to read the mapping itself
+int Resource::file()const{
+	return map?map->file():rsrc;
+}
+
+// the whole resource if it's in memory (cached files, and html files until Resource::get takes from it) or mapped, NULL otherwise
+const char *Resource::data()const{
+	if(contents)
+		return contents->response.data()+contents->header_length;
+	if(map)
+		return map->size()>0?map->data():""; // empty files have nothing mapped
+
+	return rsrc==-1?html_file.c_str():NULL;
+}
+
+// share one read only mapping of each non html file between everyone serving it, instead of opening it every time
+void Resource::map_files(bool enable){
+	mapped=enable;
+}
+
+// how to treat the page cache for files at least <size> bytes long (STREAM_*)
+void Resource::stream_files(int policy,long long size){
+	stream_policy=policy;
+	stream_size=size;
+}
+
+// safe to call from any thread
+stream_counts Resource::streamed(){
+	stream_counts c;
+	c.files=stream_files_count.load(std::memory_order_relaxed);
+	c.readahead=stream_readahead.load(std::memory_order_relaxed);
+	c.dropped=stream_dropped.load(std::memory_order_relaxed);
+
+	return c;
+}
+
+// files are served from the current directory, remember where that is
+// returns false if it can't be figured out
+bool Resource::serve_current_dir(){
+	return get_working_dir(root);
+}
+
+// walk the document root and index everything in it, so requests for those files don't have to look for them
+// replaces the old index if there was one, returns how many paths are in the new one
+unsigned Resource::index_files(){
+	std::vector<indexed_file> found;
+	walk([&found](const std::string &path,const std::string &canon){
+		indexed_file f;
+		f.path=path;
+		f.name=path;
+		f.canon=canon;
+		if(!file_stamp(canon,f.size,f.mtime))
+			return;
+		f.type=get_type(path);
+		found.push_back(f);
+
+		// directories are served by their index.html, with or without a trailing slash
+		const size_t slash=path.rfind('/');
+		if(path.compare(slash==std::string::npos?0:slash+1,std::string::npos,"index.html")==0){
+			if(slash==std::string::npos){
+				f.path="./";
+				found.push_back(f);
+			}
+			else{
+				f.path=path.substr(0,slash);
+				found.push_back(f);
+				f.path+="/";
+				found.push_back(f);
+			}
+		}
+	});
+
+	const unsigned count=found.size();
+	index.store(std::shared_ptr<const Index>(new Index(std::move(found))));
+	return count;
+}
+
+// write compressed variants, in every encoding compressors() can do, next to each compressible file that doesn't have an up to date one
+// for Resource::encoded to find. files that hardly get any smaller, and html pages with includes, are left alone
+// returns how many variants were written, stops early if the server is shutting down
+unsigned Resource::compress_files(){
+	unsigned written=0;
+	walk([&written](const std::string &path,const std::string &canon){
+		long long size,mtime;
+		if(!running.load()||!compressible(get_type(path))||!file_stamp(path,size,mtime)||size<COMPRESS_MIN||size>COMPRESS_MAX)
+			return;
+
+		std::string raw;
+		for(int encoding:{ENCODING_GZIP,ENCODING_BROTLI}){
+			if(!(compressors()&encoding))
+				continue;
+
+			// made since the file last changed
+			const std::string variant=path+encoding_extension(encoding);
+			long long variant_size,variant_mtime;
+			if(file_stamp(variant,variant_size,variant_mtime)&&variant_mtime>=mtime)
+				continue;
+
+			if(raw.empty()){
+				const int fd=open_canonical(canon);
+				if(fd==-1)
+					return;
+				raw.resize(size);
+				long long got=0;
+				int n;
+				while(got<size&&(n=read_file(fd,&raw[0]+got,size-got,got))>0)
+					got+=n;
+				close_file(fd);
+				if(got!=size)
+					return;
+
+				// html pages with server side includes are always sent rendered, Resource::encoded won't use a variant
+				if(!strcmp(get_type(path),"text/html")){
+					std::string rendered=raw;
+					std::vector<cached_source> included;
+					try{
+						html(rendered,included);
+					}catch(const SessionError&){
+						return;
+					}
+					if(!included.empty())
+						return;
+				}
+			}
+
+			std::string packed;
+			if(!compress(encoding,raw,packed)||packed.length()>raw.length()*COMPRESS_WORTH/100)
+				continue;
+
+			// the file may have changed while it was being compressed, then the variant would look newer than it really is
+			long long now_size,now_mtime;
+			if(!file_stamp(path,now_size,now_mtime)||now_size!=size||now_mtime!=mtime)
+				return;
+
+			if(replace_file(variant,packed.data(),packed.length()))
+				++written;
+		}
+	});
+
+	return written;
+}
+
+// call <visit> with the path (relative to the document root) and canonical path of every file under the document root
+// symlinked directories aren't followed, what's under them is still found the slow way
+void Resource::walk(const std::function<void(const std::string&,const std::string&)> &visit){
+	std::vector<std::string> dirs(1,"");
+	while(!dirs.empty()){
+		const std::string dir=dirs.back();
+		dirs.pop_back();
+
+		std::vector<std::string> names;
+		if(!list_directory(dir.empty()?".":dir,names))
+			continue;
+
+		for(const std::string &name:names){
+			if(temporary(name))
+				continue;
+
+			const std::string path=dir.empty()?name:dir+"/"+name;
+
+			std::string canon;
+			if(!canonical_path(path,canon)||!inside_root(canon))
+				continue;
+
+			if(is_directory(path)){
+				if(direct_path(path,canon))
+					dirs.push_back(path);
+				continue;
+			}
+
+			visit(path,canon);
+		}
+	}
+}
+
+// the variant of <rc> in one of <encodings> (ENCODING_* bits), brotli first since it's smaller
+// variants are sibling files with the encoding's extension ("style.css.br"), made by Resource::compress_files or by hand
+// returns NULL if there isn't one, or it's older than <rc>
+std::unique_ptr<Resource> Resource::encoded(const Resource &rc,int encodings){
+	// html files' variants are made from them as they are on disk, without server side includes
+	if(rc.content_encoding!=0||!compressible(rc.content_type)||!rc.includes.empty())
+		return NULL;
+
+	const std::shared_ptr<const Index> files=index.load();
+	for(int encoding:{ENCODING_BROTLI,ENCODING_GZIP}){
+		if(!(encodings&encoding))
+			continue;
+
+		const std::string name=rc.fname+encoding_extension(encoding);
+		const indexed_file *indexed=files?files->find(name):NULL;
+		long long size,mtime;
+		if(indexed!=NULL&&watching)
+			mtime=indexed->mtime;
+		else if(!file_stamp(indexed!=NULL?indexed->canon:name,size,mtime))
+			continue;
+
+		// made before the file last changed
+		if(mtime<rc.source.mtime)
+			continue;
+
+		try{
+			std::string canon;
+			if(indexed!=NULL)
+				canon=indexed->canon;
+			else
+				check_valid(name,canon);
+
+			return std::unique_ptr<Resource>(new Resource(name,canon,rc.content_type,encoding,indexed));
+		}catch(const SessionError&){
+			continue;
+		}
+	}
+
+	return NULL;
+}
+
+// whether files of <type> are worth compressing
+bool Resource::compressible(const char *type){
+	return !strncmp(type,"text/",5)||!strcmp(type,"application/javascript");
+}
+
+// keep the index, the checked paths and the cache up to date with <watcher>'s changes
+// cached html pages' includes aren't checked on every request after this
+void Resource::watch_files(Watcher &watcher){
+	watcher.subscribe(Resource::changed);
+	watching=true;
+}
+
+// bring everything that knows about files up to date with <changes>, see Resource::watch_files
+void Resource::changed(const std::vector<file_change> &changes){
+	std::unordered_set<std::string> changed_paths; // everything in <changes>
+	std::unordered_set<std::string> moved_paths; // added or removed, which takes anything under them along if they're directories
+	bool everything=false;
+	for(const file_change &change:changes){
+		if(temporary(change.path))
+			continue;
+
+		everything=everything||change.kind==FILE_RESCAN;
+		changed_paths.insert(change.path);
+		if(change.kind!=FILE_CHANGED)
+			moved_paths.insert(change.path);
+	}
+
+	if(changed_paths.empty())
+		return;
+
+	// the index goes first, so nothing looked up from now on is where it was before
+	// files that were only written to are still where they were, they just need their new sizes and modification times
+	const std::shared_ptr<const Index> files=index.load();
+	if(everything||!moved_paths.empty()){
+		if(files)
+			index_files();
+		paths.clear();
+	}
+	else if(files)
+		index.store(files->restamp(changed_paths));
+
+	if(!cache)
+		return;
+
+	// whether <name> (relative to the document root) was changed, or was under a directory that was moved
+	auto affected=[&](const std::string &name){
+		if(changed_paths.count(name))
+			return true;
+
+		for(size_t slash=name.find('/');slash!=std::string::npos;slash=name.find('/',slash+1)){
+			if(moved_paths.count(name.substr(0,slash)))
+				return true;
+		}
+
+		return false;
+	};
+
+	const size_t prefix=root.back()=='/'?root.length():root.length()+1;
+	cache->erase_if([&](const std::string &canon,const cached_file &entry){
+		if(everything||affected(canon.substr(prefix)))
+			return true;
+
+		for(const cached_source &source:entry.includes){
+			if(affected(source.name.compare(0,2,"./")==0?source.name.substr(2):source.name))
+				return true;
+		}
+
+		return false;
+	});
+}
+
+// keep up to <size> bytes of small files in memory, html files as rendered, 0 to not
+void Resource::cache_files(long long size){
+	if(size>0)
+		cache.reset(new Cache(size));
+	else
+		cache.reset();
+}
+
+// safe to call from any thread
+cache_counts Resource::cached(){
+	if(cache)
+		return cache->counts();
+
+	cache_counts c={};
+	return c;
+}
+
+// read all of the file, at canonical path <canon>, for the cache
+// returns NULL if it couldn't be read, was changing while it was, or isn't a plain file (pipes never end the same way twice)
+std::shared_ptr<const cached_file> Resource::read_whole(const std::string &canon)const{
+	if(!is_regular_file(canon))
+		return NULL;
+
+	const int fd=open_canonical(canon);
+	if(fd==-1)
+		return NULL;
+
+	std::shared_ptr<cached_file> entry=new_entry(fsize);
+	entry->response.resize(entry->header_length+fsize);
+	char *const body=&entry->response[0]+entry->header_length;
+
+	long long got=0;
+	while(got<fsize){
+		const int n=read_file(fd,body+got,fsize-got,got);
+		if(n<1)
+			break;
+
+		got+=n;
+	}
+
+	// one more byte means it grew
+	char extra;
+	const bool complete=got==fsize&&read_file(fd,&extra,1,got)==0;
+	close_file(fd);
+
+	return complete?entry:NULL;
+}
+
+// a cache entry for the file as it was when it was opened
+// with the header for a <length> byte body already in it, the contents go after it
+std::shared_ptr<cached_file> Resource::new_entry(long long length)const{
+	std::shared_ptr<cached_file> entry(new cached_file);
+	Session::construct_response_header(HTTP_STATUS_OK,length,content_type,entry->response,headers());
+	entry->header_length=entry->response.length();
+	entry->size=source.size;
+	entry->mtime=source.mtime;
+	entry->type=content_type;
+	entry->encoding=content_encoding;
+
+	return entry;
+}
+
+// take the resource from the cache if it's there, otherwise if it's an html file process it for server side includes
+// otherwise map it or just open it, <canon> is its canonical path
+// the size and modification time come from <indexed> if it isn't NULL and the watcher keeps them up to date
+// it's only ever opened at <canon> (see open_canonical), returns false if it isn't there anymore
+bool Resource::init_file(const std::string &canon,const indexed_file *indexed){
+	// it may have gone or changed since its path was checked (or indexed)
+	long long mtime;
+	if(indexed!=NULL&&watching){
+		fsize=indexed->size;
+		mtime=indexed->mtime;
+	}
+	else if(!file_stamp(canon,fsize,mtime))
+		return false;
+
+	source.name=fname;
+	source.size=fsize;
+	source.mtime=mtime;
+
+	// small files, and html files as rendered, are served from memory
+	if(cache&&fsize<=CACHE_MAX_FILE){
+		contents=cache->find(canon,fsize,mtime,content_type,content_encoding,!watching);
+		if(contents){
+			includes=contents->includes;
+			fsize=contents->response.length()-contents->header_length;
+			return true;
+		}
+	}
 
-		std::ifstream f(fname, std::ifstream::binary); // opening at the end
-		if(!f)
-			throw SessionErrorInternal(std::string("couldn't open \"")+fname+"\" ("+content_type+")");
+	// html files are processed differently (their compressed variants aren't, there's no html in them to process)
+	if(!strcmp(content_type,"text/html")&&content_encoding==0){
+		const int len=fsize;
+		const int fd=open_canonical(canon);
+		if(fd==-1)
+			return false;
 
-		// read file
+		// read file, it may have gotten shorter since it was stat'ed
 		int read=0;
-		while(read!=len){
+		while(read<len){
 			const int get_size=4096;
-			char block[get_size+1];
-			f.read(block,get_size);
-			const int got=f.gcount();
+			char block[get_size];
+			const int got=read_file(fd,block,std::min(get_size,len-read),read);
+			if(got<1)
+				break;
 
 			read+=got;
-			block[got]=0;
-			html_file+=block;
+			html_file.append(block,got);
 		}
+		close_file(fd);
 
 		// process string
 		// inserts server side includes
-		Resource::html(html_file);
+		Resource::html(html_file,includes);
 		fsize=html_file.length();
+
+		if(cache&&fsize<=CACHE_MAX_FILE){
+			std::shared_ptr<cached_file> entry=new_entry(fsize);
+			entry->response+=html_file;
+			entry->includes=includes;
+			html_file.clear();
+
+			contents=entry;
+			cache->insert(canon,contents);
+		}
 	}
 	else{ // not an html file
-		// figure out length of file
-		fsize=filesize(fname);
-		if(fsize == -1)
-			throw SessionErrorInternal("could not stat file \"" + fname + "\"");
-
-		// if it made it this far, <fname> must be safe
-		rsrc.open(fname,std::ifstream::binary); // opening at the end
-		if(!rsrc)
-			throw SessionErrorInternal(std::string("couldn't open \"")+fname+"\" in read mode");
+		// small files are read whole and kept
+		if(cache&&fsize<=CACHE_MAX_FILE){
+			contents=read_whole(canon);
+			if(contents){
+				cache->insert(canon,contents);
+				return true;
+			}
+		}
+
+		if(mapped){
+			map=Mapping::get(canon,fsize,mtime);
+			return map!=NULL;
+		}
+
+		rsrc=open_canonical(canon);
+		if(rsrc==-1)
+			return false;
+
+		// big files are read once front to back, audio and video sooner than the rest
+		const bool media=!strncmp(content_type,"video/",6)||!strncmp(content_type,"audio/",6);
+		if(stream_policy!=STREAM_NONE&&(fsize>=stream_size||(media&&fsize>=RESOURCE_READAHEAD))){
+			streaming=true;
+			advise_file(rsrc,0,0,FILE_ADVICE_SEQUENTIAL);
+			if(stream_policy==STREAM_DROPBEHIND)
+				advise_file(rsrc,0,0,FILE_ADVICE_NOREUSE);
+			++stream_files_count;
+		}
+	}
+
+	return true;
+}
+
+// the body has been sent up to <position>, keep a window of the file read ahead of it
+// and, when dropping behind, let go of what's already gone out
+void Resource::advance(long long position){
+	if(!streaming)
+		return;
+
+	// starting over somewhere else (a range)
+	if(position<behind||position>ahead){
+		ahead=position;
+		behind=position;
+	}
+
+	// the kernel reads the next window in while the socket drains this one
+	if(position+RESOURCE_READAHEAD/2>=ahead&&ahead<fsize){
+		const long long len=std::min((long long)RESOURCE_READAHEAD,fsize-ahead);
+		if(advise_file(rsrc,ahead,len,FILE_ADVICE_WILLNEED))
+			stream_readahead.fetch_add(len,std::memory_order_relaxed);
+		ahead+=len;
+	}
+
+	if(stream_policy==STREAM_DROPBEHIND&&position-behind>=RESOURCE_READAHEAD){
+		if(advise_file(rsrc,behind,position-behind,FILE_ADVICE_DONTNEED))
+			stream_dropped.fetch_add(position-behind,std::memory_order_relaxed);
+		behind=position;
 	}
 }
 
-// fill in server side includes
+// fill in server side includes, every file they pull in (including through other html files) is added to <included>
 // example syntax: "####include.html"
-void Resource::html(std::string &stream){
+void Resource::html(std::string &stream,std::vector<cached_source> &included){
 	int pos=-1;
 	while((pos=stream.find("####",pos+1))!=std::string::npos){
 		// make sure it's on a line of its own
@@ -170,15 +696,21 @@ void Resource::html(std::string &stream){
 			Resource rc(include_name);
 			const int len=rc.size();
 			int read=0;
-			while(read!=len){
+			while(read<len){
 				const int get_size=1024;
-				char block[get_size+1];
+				char block[get_size];
 
+				// it may have gotten shorter since it was stat'ed
 				const int got=rc.get(block,get_size);
-				block[got]=0;
-				include_text+=block;
+				if(got<1)
+					break;
+
+				include_text.append(block,got);
 				read+=got;
 			}
+
+			included.push_back(rc.source);
+			included.insert(included.end(),rc.includes.begin(),rc.includes.end());
 		}catch(const SessionError &se){
 			throw SessionErrorInternal(std::string("error when including file: ")+se.what());
 		}
@@ -188,21 +720,51 @@ void Resource::html(std::string &stream){
 	}
 }
 
-// check input file
-void Resource::check_valid(const std::string &target){
+// check input file, fills in its canonical path in <canon>
+void Resource::check_valid(const std::string &target,std::string &canon){
+	// half written files
+	if(temporary(target))
+		throw SessionErrorNotFound(target);
+
+	// paths that were fine before still are, unless files have moved since (Resource::changed forgets them then)
+	// they're opened at the path they resolved to and not followed anywhere else, see Resource::init_file
+	if(paths.find(target,canon))
+		return;
+
 	// canonicalize path
-	std::string canon;
 	if(!canonical_path(target,canon))
 		throw SessionErrorNotFound(target);
 
-	// get the current working directory
-	std::string cwd;
-	if(!get_working_dir(cwd))
-		throw SessionErrorInternal("couldn't get cwd");
-
-	// make sure that the cwd is the first bit of <target>
-	if(canon.find(cwd)!=0)
+	// make sure it's inside the document root
+	if(!inside_root(canon))
 		throw SessionErrorForbidden(target);
+
+	// paths through symlinks are resolved every time, a link can be pointed somewhere else at any moment
+	if(direct_path(target,canon))
+		paths.insert(target,canon);
+}
+
+// whether <target> (relative to the document root) got to canonical path <canon> without going through symlinks
+bool Resource::direct_path(const std::string &target,const std::string &canon){
+	const std::string literal=target.compare(0,2,"./")==0?target.substr(2):target;
+	const size_t prefix=root.back()=='/'?root.length():root.length()+1;
+
+	return canon.length()==prefix+literal.length()&&canon.compare(prefix,std::string::npos,literal)==0;
+}
+
+// whether <path> is one of replace_file's temporary files, which are never served
+bool Resource::temporary(const std::string &path){
+	const size_t slash=path.find_last_of("/\\");
+	return path.compare(slash==std::string::npos?0:slash+1,strlen(TEMP_FILE_PREFIX),TEMP_FILE_PREFIX)==0;
+}
+
+// whether canonical path <canon> is the document root or something under it
+bool Resource::inside_root(const std::string &canon){
+	if(root.empty()||canon.compare(0,root.length(),root)!=0)
+		return false;
+
+	// "/srv/www2" isn't under "/srv/www"
+	return canon.length()==root.length()||root.back()=='/'||root.back()=='\\'||canon[root.length()]=='/'||canon[root.length()]=='\\';
 }
 
 // get the content type given the filename
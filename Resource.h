@@ -1,26 +1,91 @@
 #include <fstream>
 
+// what's done about the page cache for big files, see Resource::stream_files
+#define STREAM_NONE 0 // leave it to the kernel
+#define STREAM_SEQUENTIAL 1 // read them ahead of the socket
+#define STREAM_DROPBEHIND 2 // and drop what's been sent, so they don't push smaller hot files out of the cache
+#define RESOURCE_READAHEAD (2<<20) // how far ahead of the socket streamed files are read
+#define DEFAULT_STREAM_SIZE (8<<20) // files at least this big are streamed (audio and video at least RESOURCE_READAHEAD)
+
+#define COMPRESS_MIN 256 // smaller files aren't worth compressing, see Resource::compress_files
+#define COMPRESS_MAX (64<<20) // bigger ones take too long
+#define COMPRESS_WORTH 90 // percent of its size a variant can be at most
+
+// what streaming has done so far, see Resource::stream_counts
+struct stream_counts{
+	unsigned long long files; // files opened for streaming
+	unsigned long long readahead; // bytes asked to be read ahead
+	unsigned long long dropped; // bytes dropped from the page cache after being sent
+};
+
 class Resource{
 public:
 	Resource(const std::string&);
 	Resource(const Resource&)=delete;
 	Resource(Resource&&);
+	~Resource();
 	Resource &operator=(const Resource&)=delete;
 	const std::string &name()const;
 	int get(char*,int);
 	long long size()const;
 	const char *type()const;
+	const char *encoding()const;
+	const char *headers()const;
+	int file()const;
+	const char *data()const;
+	const std::string *response()const;
+	void advance(long long);
+	static void map_files(bool);
+	static void stream_files(int,long long);
+	static stream_counts streamed();
+	static bool serve_current_dir();
+	static unsigned index_files();
+	static unsigned compress_files();
+	static std::unique_ptr<Resource> encoded(const Resource&,int);
+	static void watch_files(Watcher&);
+	static void cache_files(long long);
+	static cache_counts cached();
 
 private:
-	void init_file();
-	static void html(std::string&);
-	static void check_valid(const std::string&);
+	Resource(const std::string&,const std::string&,const char*,int,const indexed_file*);
+	bool init_file(const std::string&,const indexed_file* = NULL);
+	std::shared_ptr<const cached_file> read_whole(const std::string&)const;
+	std::shared_ptr<cached_file> new_entry(long long)const;
+	static void html(std::string&,std::vector<cached_source>&);
+	static void changed(const std::vector<file_change>&);
+	static void check_valid(const std::string&,std::string&);
+	static bool inside_root(const std::string&);
+	static bool temporary(const std::string&);
+	static bool direct_path(const std::string&,const std::string&);
+	static void walk(const std::function<void(const std::string&,const std::string&)>&);
+	static bool compressible(const char*);
 	static const char *get_type(const std::string&);
 	static void get_ext(const std::string&,std::string&);
 
 	long long fsize;
 	std::string fname;
 	std::string html_file;
-	std::ifstream rsrc;
+	int rsrc; // file descriptor, -1 for html files (they're kept in <html_file>)
+	std::shared_ptr<const Mapping> map; // the file's contents if files are mapped, then <rsrc> isn't used
+	std::shared_ptr<const cached_file> contents; // the file's contents if it came from the cache, then <rsrc> and <html_file> aren't used
+	cached_source source; // the file itself, as it was when it was opened
+	std::vector<cached_source> includes; // what <html_file> or <contents> pulled in with server side includes
+	long long offset; // how far Resource::get has read <rsrc>, <map> or <contents>
 	const char *content_type;
+	int content_encoding; // ENCODING_* if this is a compressed variant of the file that was asked for, 0 otherwise
+	bool streaming; // <rsrc> is big enough to be read ahead, see Resource::advance
+	long long ahead; // <rsrc> has been read ahead up to here
+	long long behind; // <rsrc> has been dropped from the page cache up to here
+
+	static bool mapped; // see Resource::map_files
+	static int stream_policy; // see Resource::stream_files
+	static long long stream_size;
+	static std::atomic<unsigned long long> stream_files_count; // see Resource::streamed
+	static std::atomic<unsigned long long> stream_readahead;
+	static std::atomic<unsigned long long> stream_dropped;
+	static std::unique_ptr<Cache> cache; // see Resource::cache_files
+	static std::string root; // canonical path of the document root, see Resource::serve_current_dir
+	static PathCache paths; // requested paths already found to be inside <root>, see Resource::check_valid
+	static std::atomic<std::shared_ptr<const Index>> index; // see Resource::index_files
+	static bool watching; // see Resource::watch_files
 };
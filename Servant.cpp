@@ -1,58 +1,571 @@
+#include <stdint.h>
+
 #include "Servant.h"
 
-unsigned Servant::session_id=0;
+// user data for ring operations that don't belong to a session (session keys fit in 32 bits)
+#define RING_TIMEOUT (1ull<<32)
+#define RING_REACTOR (2ull<<32)
+#define RING_CANCEL (3ull<<32)
+
+// reactor data for the shutdown event
+// registry keys always have a generation in their high bits, so this is never one
+#define SHUTDOWN_TAG ((void*)(uintptr_t)1)
+
+std::atomic<unsigned> Servant::session_id(0);
+
+// sessions are handled on <workers> if not NULL, otherwise on the thread calling Servant::wait
+// their disk i/o is done on <disk_workers> if not NULL (also the thread calling Servant::wait otherwise)
+// connections talk https using <tls_settings> if not NULL, they're shared by all shards so sessions can be resumed on any of them
+// with more than one shard, other Servants can listen on the same port, see tcp_server::bind
+// <cpu> is where the thread calling Servant::wait runs, -1 if it isn't pinned
+Servant::Servant(const config &cfg,WorkerPool *workers,WorkerPool *disk_workers,net::tls_context *tls_settings,int cpu):completed(NULL),scan(cfg.port,cfg.shards>1),ticking(false),pool(workers),disk(disk_workers),tls(tls_settings),busy(0),max_sessions(cfg.max_sessions),max_pending(cfg.max_pending),pending(0),rejected(0),blocked(0){
+	last_expire=time(NULL);
+
+	// ask for connections that arrive on this shard's cpu
+	if(cfg.steer&&cpu!=-1)
+		scan.incoming_cpu(cpu);
 
-Servant::Servant(unsigned short port):scan(port){
+	// wake up as soon as the server is asked to stop
+	if(shutdown_event()!=-1)
+		reactor.add(shutdown_event(),REACTOR_READ,SHUTDOWN_TAG);
+
+	// the listening socket is the only thing registered without a session key
+	if(scan&&!reactor.add(scan.get_socket(),REACTOR_READ,NULL))
+		scan.close();
+
+	// with io_uring the reactor only watches the listening socket, and the ring watches the reactor
+	if(cfg.uring){
+		ring.reset(new Uring(URING_ENTRIES,URING_SLOTS));
+		ring->poll(reactor.get_fd(),RING_REACTOR);
+	}
 }
 
+// the sessions must all be back, see Servant::finish
 Servant::~Servant(){
-	// join all the sessions
-	for(std::thread &t:sessions)
-		t.join();
+	// drop all the sessions
+	for(unsigned key=sessions.first();key!=0;key=sessions.next(key)){
+		session_entry &entry=*sessions.find(key);
+		if(ring)
+			ring->release(entry.slot);
+		else
+			reactor.remove(entry.session->get_socket());
+	}
+}
+
+// get back all the sessions with operations in flight or out on the pools, waiting up to <seconds> for them
+// returns false if some are still out after that (stuck on a disk that stopped answering), then the shard can't be destroyed
+bool Servant::finish(unsigned seconds){
+	const time_t deadline=time(NULL)+seconds;
+
+	if(ring){
+		for(unsigned key=sessions.first();key!=0;key=sessions.next(key)){
+			if(sessions.find(key)->busy)
+				ring->cancel(key,RING_CANCEL);
+		}
+
+		while(busy>0&&time(NULL)<deadline){
+			// check the deadline at least once a second, even with nothing coming back
+			if(!ticking){
+				ring->timeout(1000,RING_TIMEOUT);
+				ticking=true;
+			}
+
+			const int max_completions=64;
+			uring_completion done[max_completions];
+
+			const int count=ring->wait(done,max_completions);
+			for(int i=0;i<count;++i){
+				if(done[i].data<RING_TIMEOUT){
+					--busy;
+				}
+				else if(done[i].data==RING_TIMEOUT){
+					ticking=false;
+				}
+				else if(done[i].data==RING_REACTOR){
+					// sessions back from the disk pool
+					reactor_event events[1];
+					reactor.wait(events,1,0);
+					for(session_entry *entry=completed.exchange(NULL,std::memory_order_acquire);entry!=NULL;entry=entry->next_done)
+						--busy;
+
+					ring->poll(reactor.get_fd(),RING_REACTOR);
+				}
+			}
+		}
+
+		return busy==0;
+	}
+
+	// wait for the workers to give back the sessions they're handling
+	while(busy>0&&time(NULL)<deadline){
+		reactor_event events[1];
+		reactor.wait(events,1,100);
+
+		for(session_entry *entry=completed.exchange(NULL,std::memory_order_acquire);entry!=NULL;entry=entry->next_done)
+			--busy;
+	}
+
+	return busy==0;
 }
 
 bool Servant::operator!()const{
-	return !scan;
+	return !scan||!reactor||(ring&&!*ring);
+}
+
+// wait for and process socket events
+// returns after at most a second while there are sessions, blocks until something happens otherwise
+// also returns once the server is asked to stop
+void Servant::wait(){
+	if(ring){
+		wait_ring();
+		expire();
+		return;
+	}
+
+	// without a shutdown event, check back on the running flag every now and then
+	const int forever=shutdown_event()==-1?1000:-1;
+	wait_reactor(quiet()?forever:1000);
+	expire();
+}
+
+// stop taking connections, and give the sessions up to <seconds> to finish the responses they're working on
+// sessions waiting for a request are ended right away
+// returns early if the shutdown stops being graceful (see graceful_shutdown)
+void Servant::drain(unsigned seconds){
+	const time_t deadline=time(NULL)+seconds;
+
+	if(scan){
+		reactor.remove(scan.get_socket());
+		scan.close();
+	}
+	while(!waiting.empty()){
+		reject(waiting.front().peer);
+		waiting.pop_front();
+		--pending;
+	}
+
+	for(;;){
+		retire(time(NULL),true);
+		if(sessions.size()==0||!graceful_shutdown()||time(NULL)>=deadline)
+			break;
+
+		if(ring)
+			wait_ring();
+		else
+			wait_reactor(100);
+	}
+}
+
+// safe to call from any thread
+servant_counts Servant::counts()const{
+	servant_counts c;
+	c.live=sessions.size();
+	c.busy=busy.load(std::memory_order_relaxed);
+	c.pending=pending.load(std::memory_order_relaxed);
+	c.rejected=rejected.load(std::memory_order_relaxed);
+	c.blocked=blocked.load(std::memory_order_relaxed);
+
+	return c;
+}
+
+// wait up to <millis> milliseconds (-1 for no limit) for socket events, and process them
+void Servant::wait_reactor(int millis){
+	const int max_events=64;
+	reactor_event events[max_events];
+
+	const int count=reactor.wait(events,max_events,millis);
+	for(int i=0;i<count;++i){
+		if(events[i].data==NULL)
+			accept();
+		else if(events[i].data!=SHUTDOWN_TAG)
+			handle((uintptr_t)events[i].data,events[i].events);
+	}
+
+	cleanup();
 }
 
+// nothing is going on that needs a timer
+bool Servant::quiet()const{
+	return sessions.size()==0&&waiting.empty();
+}
+
+// accept all pending connections
+// past <max_sessions> they wait their turn in <waiting>, and once that's full they're turned away
 void Servant::accept(){
-	const int sock=scan.accept(1000);
+	net::tcp peer;
+	while(scan.accept(peer)){
+		if(max_sessions==0||sessions.size()<max_sessions){
+			admit(std::move(peer));
+		}
+		else if(waiting.size()<max_pending){
+			pending_connection c;
+			c.peer=std::move(peer);
+			c.since=time(NULL);
+			waiting.push_back(std::move(c));
+			++pending;
+		}
+		else{
+			reject(peer);
+		}
+	}
+}
 
-	if(sock==-1)
+// start a session for <peer>
+void Servant::admit(net::tcp &&peer){
+	const int sock=peer.get_socket();
+	if(tls!=NULL&&!peer.start_tls(*tls))
 		return;
 
-	sessions.push_back(std::thread(Session::entry,this,sock,++Servant::session_id));
+	session_entry e;
+	e.busy=false;
+	e.events=0;
+	e.cancelled=false;
+	e.staging=false;
+	e.alive=true;
+	e.loaded=false;
+	e.result=0;
+	e.next_done=NULL;
 
-	cleanup();
+	// sessions on the ring do their i/o out of their slot's registered buffer
+	e.slot=ring?ring->acquire(sock):-1;
+	if(e.slot!=-1)
+		e.session.reset(new Session(std::move(peer),++Servant::session_id,ring->buffer(e.slot),URING_SLOT_BUFFER_SIZE));
+	else
+		e.session.reset(new Session(std::move(peer),++Servant::session_id));
+	e.interest=e.session->interest();
+
+	const unsigned key=sessions.insert(std::move(e));
+	if(key==0){
+		// full, session destructor closes the socket
+		if(ring)
+			ring->release(e.slot);
+		return;
+	}
+
+	session_entry &entry=*sessions.find(key);
+	entry.key=key;
+
+	if(ring){
+		submit(entry);
+		return;
+	}
+
+	if(!reactor.add(sock,entry.interest,(void*)(uintptr_t)key))
+		sessions.erase(key);
 }
 
-// called by Session::entry to notify Servant of completed session
-void Servant::complete(){
-	std::lock_guard<std::mutex> lock(mut);
-	completed.push_back(std::this_thread::get_id());
+// turn <peer> away with a 503, it's closed once <peer> goes out of scope
+void Servant::reject(net::tcp &peer){
+	// built once, it's the same every time
+	static const std::string response=[](){
+		std::string r;
+		Session::construct_error_response(HTTP_STATUS_UNAVAILABLE,r);
+		return r;
+	}();
+
+	// the socket buffer is empty, it'll fit
+	// https clients just get hung up on, they'd need a handshake first
+	if(tls==NULL)
+		peer.send_nonblock(response.c_str(),response.length());
+	++rejected;
 }
 
-// cleanup completed sessions
+// forward socket events to the session
+void Servant::handle(unsigned key,int events){
+	session_entry *entry=sessions.find(key);
+	if(entry==NULL)
+		return;
+
+	// a worker or the disk pool already has it, it'll be rescheduled when it comes back
+	if(entry->busy){
+		entry->events|=events;
+		return;
+	}
+
+	if(pool==NULL){
+		if(entry->session->handle(events))
+			resume(*entry);
+		else
+			end(*entry);
+		return;
+	}
+
+	dispatch(*entry,events);
+}
+
+// hand a session off to the worker pool
+void Servant::dispatch(session_entry &entry,int events){
+	session_entry *e=&entry;
+
+	entry.busy=true;
+	entry.events=0;
+	++busy;
+
+	// a session back from the disk pool gets the result of its disk operation first
+	const bool loaded=entry.loaded;
+	entry.loaded=false;
+
+	pool->submit([this,e,events,loaded](){
+		complete(e,(!loaded||e->session->complete(e->result))&&e->session->handle(events));
+	});
+}
+
+// run a session's SESSION_OP_DISK on the disk pool, it comes back through Servant::complete like it would from a worker
+void Servant::load(session_entry &entry){
+	session_entry *e=&entry;
+
+	entry.busy=true;
+	++busy;
+
+	auto job=[this,e](){
+		e->result=e->session->operation().disk();
+		e->loaded=true;
+		complete(e,true);
+	};
+
+	if(disk!=NULL)
+		disk->submit(job);
+	else
+		job();
+}
+
+// called by the workers and the disk pool to give a session back to the reactor thread
+void Servant::complete(session_entry *entry,bool alive){
+	entry->alive=alive;
+
+	session_entry *head=completed.load(std::memory_order_relaxed);
+	do{
+		entry->next_done=head;
+	}while(!completed.compare_exchange_weak(head,entry,std::memory_order_release,std::memory_order_relaxed));
+
+	// whoever made the list non-empty already woke the reactor
+	if(head==NULL)
+		reactor.wake();
+}
+
+// take back the sessions the workers and the disk pool are done with
 void Servant::cleanup(){
-	// get rid of completed threads
-	std::lock_guard<std::mutex> lock(mut);
-	for(std::vector<std::thread::id>::iterator it=completed.begin();it!=completed.end();){
-		std::thread::id id=*it;
-
-		// find id in sessions and delete it
-		for(std::vector<std::thread>::iterator it2=sessions.begin();it2!=sessions.end();){
-			std::thread &thread=*it2;
-
-			if(thread.get_id()==id){
-				thread.join();
-				it2=sessions.erase(it2);
-				break;
+	session_entry *entry=completed.exchange(NULL,std::memory_order_acquire);
+	while(entry!=NULL){
+		session_entry *next=entry->next_done;
+		--busy;
+
+		entry->busy=false;
+		if(!entry->alive){
+			end(*entry);
+		}
+		else if(entry->loaded&&ring){
+			// the ring carries on with whatever the session does next
+			entry->loaded=false;
+			if(entry->session->complete(entry->result))
+				submit(*entry);
+			else
+				end(*entry);
+		}
+		else if(entry->loaded&&pool==NULL){
+			// hand over the disk operation's result, and anything that happened on the socket in the meantime
+			entry->loaded=false;
+			const int events=entry->events;
+			entry->events=0;
+			if(entry->session->complete(entry->result)&&entry->session->handle(events))
+				resume(*entry);
+			else
+				end(*entry);
+		}
+		else if(entry->loaded){
+			dispatch(*entry,entry->events);
+		}
+		else{
+			resume(*entry);
+
+			// run it again if something happened while it was out
+			if(!entry->busy&&entry->events!=0)
+				dispatch(*entry,entry->events);
+		}
+
+		entry=next;
+	}
+}
+
+// a session has finished handling some events and wants to keep going
+void Servant::resume(session_entry &entry){
+	// only touch the reactor when the session wants something different
+	const int interest=entry.session->interest();
+	if(interest!=entry.interest){
+		reactor.modify(entry.session->get_socket(),interest,(void*)(uintptr_t)entry.key);
+		entry.interest=interest;
+	}
+
+	if(entry.session->operation().type==SESSION_OP_DISK)
+		load(entry);
+}
+
+// get rid of a finished session, and let the next waiting connection in
+void Servant::end(session_entry &entry){
+	if(ring)
+		ring->release(entry.slot);
+	else
+		reactor.remove(entry.session->get_socket());
+
+	blocked.fetch_add(entry.session->blocked(),std::memory_order_relaxed);
+	sessions.erase(entry.key);
+
+	if(!waiting.empty()&&(max_sessions==0||sessions.size()<max_sessions)){
+		net::tcp peer=std::move(waiting.front().peer);
+		waiting.pop_front();
+		--pending;
+
+		admit(std::move(peer));
+	}
+}
+
+// end sessions whose keepalive timer ran out, or whose peer stopped taking the response (see Session::expired)
+void Servant::expire(){
+	const time_t now=time(NULL);
+	if(now==last_expire)
+		return;
+	last_expire=now;
+
+	// connections that have waited as long as an idle session would have lived are turned away
+	while(!waiting.empty()&&now-waiting.front().since>=HTTP_KEEPALIVE){
+		reject(waiting.front().peer);
+		waiting.pop_front();
+		--pending;
+	}
+
+	retire(now,false);
+}
+
+// end sessions whose keepalive timer ran out at <now>, with <idle> also the ones waiting for a new request
+void Servant::retire(time_t now,bool idle){
+	unsigned next;
+	for(unsigned key=sessions.first();key!=0;key=next){
+		next=sessions.next(key);
+
+		session_entry &entry=*sessions.find(key);
+		if(!entry.session->expired(now)&&!(idle&&entry.session->idle()))
+			continue;
+
+		if(ring){
+			// the ring gives the session back once its receive is cancelled
+			if(!entry.cancelled&&entry.busy){
+				ring->cancel(key,RING_CANCEL);
+				entry.cancelled=true;
 			}
+		}
+		else if(!entry.busy){
+			// can't touch sessions the workers have
+			end(entry);
+		}
+	}
+}
+
+// wait for and process ring completions, returns after at most a second
+void Servant::wait_ring(){
+	const int max_completions=64;
+	uring_completion done[max_completions];
+
+	const int count=ring->wait(done,max_completions);
+	for(int i=0;i<count;++i){
+		const uint64_t data=done[i].data;
 
-			++it2;
+		if(data==RING_TIMEOUT){
+			ticking=false;
 		}
+		else if(data==RING_REACTOR){
+			// the listening socket is ready (or the reactor was woken up by the disk pool)
+			const int max_events=64;
+			reactor_event events[max_events];
 
-		// delete id from completed vector
-		it=completed.erase(it);
+			const int ready=reactor.wait(events,max_events,0);
+			for(int j=0;j<ready;++j){
+				if(events[j].data==NULL)
+					accept();
+			}
+			cleanup();
+
+			ring->poll(reactor.get_fd(),RING_REACTOR);
+		}
+		else if(data<RING_TIMEOUT){
+			complete_ring(data,done[i].result);
+		}
 	}
+
+	// tick once a second for Servant::expire, but only while there's something to expire
+	if(!ticking&&!quiet()){
+		ring->timeout(1000,RING_TIMEOUT);
+		ticking=true;
+	}
+}
+
+// queue the session's next operation on the ring
+void Servant::submit(session_entry &entry){
+	const session_op &op=entry.session->operation();
+	const int sock=entry.session->get_socket();
+
+	switch(op.type){
+	case SESSION_OP_RECV:
+		ring->recv(sock,entry.slot,op.buf,op.len,entry.key);
+		break;
+	case SESSION_OP_DISK:
+		load(entry);
+		return;
+	case SESSION_OP_SEND:
+		if(op.head_len>0)
+			ring->send(sock,entry.slot,op.head,op.head_len,op.buf,op.len,entry.key);
+		else
+			ring->send(sock,entry.slot,op.buf,op.len,entry.key);
+		break;
+	case SESSION_OP_SENDFILE:
+		// nothing left of the file, just the head
+		if(op.len==0){
+			ring->send(sock,entry.slot,op.head,op.head_len,entry.key);
+			break;
+		}
+
+		// the ring can't send files, read a buffer's worth and send that (see Servant::complete_ring)
+		ring->read(op.fd,entry.slot,op.buf,op.len<SESSION_BUFFER_SIZE?op.len:SESSION_BUFFER_SIZE,op.offset,entry.key);
+		entry.staging=true;
+		break;
+	default:
+		// nothing the ring can do (the session is finished, or wants a tls handshake it never should on the ring)
+		end(entry);
+		return;
+	}
+
+	entry.busy=true;
+	++busy;
+}
+
+// a session's operation on the ring finished with <result>
+void Servant::complete_ring(unsigned key,int result){
+	--busy;
+
+	session_entry *entry=sessions.find(key);
+	if(entry==NULL)
+		return;
+
+	entry->busy=false;
+
+	// the file has been read into the buffer, now send it
+	if(entry->staging&&!entry->cancelled){
+		entry->staging=false;
+		if(result>0){
+			const session_op &op=entry->session->operation();
+			if(op.head_len>0)
+				ring->send(entry->session->get_socket(),entry->slot,op.head,op.head_len,op.buf,result,key);
+			else
+				ring->send(entry->session->get_socket(),entry->slot,op.buf,result,key);
+			entry->busy=true;
+			++busy;
+			return;
+		}
+	}
+
+	if(entry->cancelled||!entry->session->complete(result)){
+		end(*entry);
+		return;
+	}
+
+	submit(*entry);
 }
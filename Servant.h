@@ -2,57 +2,161 @@
 #define SERVANT_H
 
 #include <vector>
+#include <deque>
 #include <thread>
 #include <mutex>
+#include <memory>
+#include <atomic>
+#include <time.h>
 
 class Servant;
 #include "network.h"
 #include "os.h"
+#include "Reactor.h"
+#include "WorkerPool.h"
+#include "Uring.h"
+#include "Task.h"
+#include "Registry.h"
 #include "Session.h"
+#include "Mapping.h"
+#include "Cache.h"
+#include "Index.h"
+#include "Watcher.h"
+#include "Compress.h"
 #include "Resource.h"
 
 // config defaults
 #define DEFAULT_PORT 80
 #define DEFAULT_ROOTDIR "./root"
 #define DEFAULT_NAME "no one of consequence"
+#define DEFAULT_SHARDS 1
+#define DEFAULT_DISK_THREADS 4 // shared by all shards
+#define DEFAULT_MAX_SESSIONS 0 // per shard, 0 for no limit
+#define DEFAULT_MAX_PENDING 128 // per shard
+#define DRAIN_TIMEOUT 10 // seconds in-flight responses get to finish on SIGTERM
+
+// io_uring backend sizing, per Servant
+#define URING_ENTRIES 256 // submission ring size
+#define URING_SLOTS 1024 // sessions that get a fixed file and registered buffer
 
 // http errors
 #define HTTP_STATUS_OK 200
+#define HTTP_STATUS_PARTIAL_CONTENT 206
 #define HTTP_STATUS_BAD_REQUEST 400
 #define HTTP_STATUS_NOT_FOUND 404
+#define HTTP_STATUS_RANGE_NOT_SATISFIABLE 416
 #define HTTP_STATUS_INTERNAL_ERROR 500
 #define HTTP_STATUS_NOT_IMPLEMENTED 501
+#define HTTP_STATUS_UNAVAILABLE 503
 #define HTTP_STATUS_VERSION_NOT_SUPPORTED 505
 
 struct config;
 void cmdline(config&,int,char**);
 void usage(const char*);
 
+// session counts, see Servant::counts
+struct servant_counts{
+	unsigned live; // open sessions
+	unsigned busy; // sessions out on the worker pool or the disk pool, or with an operation in flight on the ring
+	unsigned pending; // connections waiting to be admitted
+	unsigned long long rejected; // connections turned away because the shard was full
+	unsigned long long blocked; // times ended sessions had to wait for a slow peer to take data
+};
+
 class Servant{
 public:
-	Servant(unsigned short);
+	Servant(const config&,WorkerPool*,WorkerPool*,net::tls_context*,int = -1);
 	Servant(const Servant&)=delete;
 	Servant(Servant&&)=delete;
 	~Servant();
 	Servant &operator=(const Session&)=delete;
 	bool operator!()const;
-	void accept();
-	void complete();
+	void wait();
+	void drain(unsigned);
+	bool finish(unsigned);
+	servant_counts counts()const;
 
 private:
+	// a session and the reactor events it is registered for
+	struct session_entry{
+		std::unique_ptr<Session> session;
+		unsigned key; // registry key, handed back by the reactor and the ring
+		int interest;
+		bool busy; // session is being handled on the worker pool or the disk pool, or has an operation in flight on the ring
+		int events; // events that came in while busy
+		int slot; // ring slot, or -1
+		bool cancelled; // in flight ring operation has been cancelled
+		bool staging; // reading the file for a SESSION_OP_SENDFILE on the ring
+		bool alive; // set by the worker, session wants to keep going
+		bool loaded; // back from the disk pool with <result> for the session
+		int result; // what the session's SESSION_OP_DISK returned
+		session_entry *next_done; // next in Servant::completed
+	};
+
+	// a connection waiting for a session to end so it can be admitted
+	struct pending_connection{
+		net::tcp peer;
+		time_t since;
+	};
+
+	void wait_reactor(int);
+	bool quiet()const;
+	void accept();
+	void admit(net::tcp&&);
+	void reject(net::tcp&);
+	void handle(unsigned,int);
+	void dispatch(session_entry&,int);
+	void complete(session_entry*,bool);
 	void cleanup();
+	void resume(session_entry&);
+	void load(session_entry&);
+	void end(session_entry&);
+	void expire();
+	void retire(time_t,bool);
+	void wait_ring();
+	void submit(session_entry&);
+	void complete_ring(unsigned,int);
 
-	std::vector<std::thread> sessions;
-	std::vector<std::thread::id> completed; // array of thread ids that have completed
+	Registry<session_entry> sessions; // live sessions
+	std::atomic<session_entry*> completed; // sessions the workers and the disk pool are done with, pushed without locking
 	net::tcp_server scan;
-	static unsigned session_id;
-	std::mutex mut; // used to protect Servant::completed
+	Reactor reactor;
+	std::unique_ptr<Uring> ring; // does the sessions' i/o when using the io_uring backend
+	bool ticking; // the ring has a timeout pending
+	WorkerPool *pool; // where sessions are handled, NULL to handle them on the reactor thread
+	WorkerPool *disk; // where sessions' SESSION_OP_DISK operations run, NULL to run them on the reactor thread
+	net::tls_context *tls; // connections talk https with these settings, NULL for plain http
+	static std::atomic<unsigned> session_id; // shared by all shards
+	std::atomic<unsigned> busy; // sessions currently out on the worker pool, the disk pool or the ring
+	const unsigned max_sessions; // admitted at once, 0 for no limit
+	const unsigned max_pending; // most connections allowed to wait in <waiting>
+	std::deque<pending_connection> waiting; // accepted while full, oldest first
+	std::atomic<unsigned> pending; // size of <waiting>, for Servant::counts
+	std::atomic<unsigned long long> rejected;
+	std::atomic<unsigned long long> blocked; // see Session::blocked, added up as sessions end
+	time_t last_expire; // last time sessions were checked for keepalive expiration
 };
 
 struct config{
 	unsigned short port;
 	std::string root;
 	unsigned uid;
+	unsigned threads; // worker pool size, 0 to handle sessions on the reactor thread
+	unsigned disk_threads; // disk pool size, 0 to do disk i/o on the reactor thread
+	unsigned shards; // listeners sharing the port, each with its own reactor thread
+	bool uring; // use the io_uring backend
+	unsigned max_sessions; // sessions each shard serves at once, 0 for no limit
+	unsigned max_pending; // connections each shard holds on to while full, the rest are turned away
+	bool steer; // steer connections to the shard on the cpu that received them (SO_INCOMING_CPU)
+	bool mapped; // serve files from shared memory mappings instead of sendfile
+	std::string cert; // serve https with this certificate chain (pem), empty for plain http
+	std::string key; // and this private key (pem)
+	int stream_policy; // page cache treatment of big files (STREAM_*)
+	long long stream_size; // files at least this big are streamed
+	long long cache_size; // bytes of small files kept in memory, 0 for none
+	bool index; // index the document root at startup
+	bool watch; // keep up with changes to the document root
+	bool compress; // write compressed variants of text files
 };
 
 #endif // SERVANT_H
@@ -1,209 +1,471 @@
 #include <iostream>
 #include <atomic>
+#include <algorithm>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
-#include <thread>
-#include <chrono>
 
 #include "Servant.h"
 
-extern std::atomic<bool> running;
 static std::mutex stdout_lock; // locks the std::cout in Session::log
 
-Session::Session(int sockfd,unsigned id):sock(sockfd),sid(id){
+// <buf> is used for i/o if given, otherwise the session allocates its own
+Session::Session(net::tcp &&s,unsigned id,char *buf,unsigned size):sock(std::move(s)),sid(id),phase(state::receiving),op_result(0),hangup(false),stalls(0){
+	if(buf==NULL){
+		own_buffer.reset(new char[SESSION_BUFFER_SIZE]);
+		buf=own_buffer.get();
+		size=SESSION_BUFFER_SIZE;
+	}
+	buffer=buf;
+	buffer_size=size;
+
 	entry_time=time(NULL);
+	log(std::string("session begin ")+sock.get_name());
+
+	// run up to the first operation
+	op.type=SESSION_OP_NONE;
+	routine=serve();
+	routine.resume();
+	settle();
 }
 
-// the entry point for the session (and this thread)
-void Session::entry(Servant *parent,int sockfd,unsigned id){
-	Session session(sockfd,id);
-	session.log(std::string("session begin ")+session.sock.get_name());
+Session::~Session(){
+	if(stalls>0){
+		char count[25];
+		sprintf(count,"%u",stalls);
+		log(std::string("session end (waited for the peer to take data ")+count+" times)");
+	}
+	else
+		log("session end");
+}
 
-	// serve the client
-	try{
-		session.serve();
-	}catch(const SessionErrorNotFound &e){
-		// file not found
-		session.log(e.what());
-		session.send_error_not_found();
-	}catch(const SessionErrorForbidden &e){
-		// forbidden file, treat as 404
-		session.log(e.what());
-		session.send_error_not_found();
-	}catch(const SessionErrorMalformed &e){
-		// malformed http request
-		session.log(e.what());
-		session.send_error_generic(HTTP_STATUS_BAD_REQUEST);
-	}catch(const SessionErrorNotSupported &e){
-		// http operation not implemented
-		session.log(e.what());
-		session.send_error_generic(HTTP_STATUS_NOT_IMPLEMENTED);
-	}catch(const SessionErrorVersion &e){
-		// http version not supported
-		session.log(e.what());
-		session.send_error_generic(HTTP_STATUS_VERSION_NOT_SUPPORTED);
-	}catch(const SessionErrorInternal &e){
-		// internal server error
-		session.log(e.what());
-		session.send_error_generic(HTTP_STATUS_INTERNAL_ERROR);
-	}catch(SessionError &se){
-		// generic catch-all
-		session.log(se.what());
+// do the session's operations directly on the socket until one would block
+// <events> are the readiness events reported by the reactor
+// returns false when the session is finished and should be destroyed
+bool Session::handle(int events){
+	if(events&REACTOR_HANGUP)
+		hangup=true;
+
+	for(;;){
+		int result=-1;
+		switch(op.type){
+		case SESSION_OP_NONE:
+			return false;
+		case SESSION_OP_RECV:
+			result=sock.recv_nonblock(op.buf,op.len);
+			if(sock.error())
+				result=-1;
+			else if(result==0&&!hangup)
+				return true; // wait for readable, no data doesn't mean end of stream until the peer hangs up
+			break;
+		case SESSION_OP_SEND:
+			result=op.head_len>0?sock.send_nonblock(op.head,op.head_len,op.buf,op.len):sock.send_nonblock(op.buf,op.len);
+			if(sock.error())
+				result=-1;
+			else if(result==0){
+				++stalls;
+				return true; // wait for writable
+			}
+			break;
+		case SESSION_OP_DISK:
+			return true; // the owner runs it off the network threads
+		case SESSION_OP_HANDSHAKE:
+			result=sock.handshake();
+			if(result==0)
+				return true; // wait for the socket
+			break;
+		case SESSION_OP_SENDFILE:
+			result=op.head_len>0?sock.send_file_nonblock(op.head,op.head_len,op.fd,op.offset,op.len):sock.send_file_nonblock(op.fd,op.offset,op.len);
+			if(sock.error())
+				result=-1;
+			else if(result==0){
+				++stalls;
+				return true; // wait for writable
+			}
+			break;
+		}
+
+		if(!complete(result))
+			return false;
 	}
+}
 
-	// let parent know it's done
-	parent->complete();
-	session.log("session end");
+// how many times a send would have blocked, the session waited for the socket to be writable instead
+unsigned Session::blocked()const{
+	return stalls;
 }
 
-// loop and take http requests till the keepalive timer runs out
-// each request resets the timer
-void Session::serve(){
-	while(time(NULL)-entry_time<HTTP_KEEPALIVE){
-		// check if anything is on the socket
-		if(sock.peek()>0){
-			// get the http request
-			std::string request;
-			get_http_request(request);
+// what the session is waiting on
+const session_op &Session::operation()const{
+	return op;
+}
 
-			// make sure it's valid
-			Session::check_http_request(request);
+// the current operation finished with <result> (bytes transferred, 0 or less for end of stream or error)
+// resumes the session until it needs another operation
+// returns false when the session is finished and should be destroyed
+bool Session::complete(int result){
+	if(!waiting)
+		return false;
 
-			// get the requested resource name from the request header
-			std::string target;
-			Session::get_target_resource(request,target);
+	// the peer is still taking the response, so it gets more time
+	if(result>0&&phase==state::sending)
+		entry_time=time(NULL);
 
-			// initialize resource
-			Resource rc(target);
-			log(std::string("request resource \""+target+"\" (")+rc.type()+")");
+	op_result=result;
+	std::coroutine_handle<> h=waiting;
+	waiting=nullptr;
+	h.resume();
+	settle();
 
-			// send the file
-			send_file(rc);
-		}
+	return op.type!=SESSION_OP_NONE;
+}
 
-		// check for exit request
-		if(!running.load())
-			throw SessionErrorExit();
+// the keepalive timer runs while waiting for a request
+// while sending, a peer that stops taking the response gets HTTP_SEND_TIMEOUT from the last bytes it took
+bool Session::expired(time_t now)const{
+	if(phase==state::sending)
+		return (op.type==SESSION_OP_SEND||op.type==SESSION_OP_SENDFILE)&&now-entry_time>=HTTP_SEND_TIMEOUT;
 
-		// check for error
-		if(sock.error())
-			return;
+	return phase==state::receiving&&now-entry_time>=HTTP_KEEPALIVE;
+}
 
-		// wait just a little bit
-		std::this_thread::sleep_for(std::chrono::milliseconds(10));
-	}
+// waiting for a request that hasn't started arriving
+bool Session::idle()const{
+	return phase==state::receiving&&request.empty();
 }
 
-void Session::get_http_request(std::string &req){
-	bool end=false;
-	const int get_size=128; // try to recv how many characters at a time
-	while(!end){
-		// make sure HTTP_KEEPALIVE seconds hasn't elapsed yet
-		if(time(NULL)-entry_time>HTTP_KEEPALIVE)
-			throw SessionErrorClosed();
+// the readiness events the session is interested in
+int Session::interest()const{
+	if(op.type==SESSION_OP_SEND||op.type==SESSION_OP_SENDFILE||op.type==SESSION_OP_HANDSHAKE)
+		return REACTOR_READ|REACTOR_WRITE;
 
-		// receive a bit of the HTTP request
-		char block[get_size+1];
-		const int received=recv(block,get_size);
+	return REACTOR_READ;
+}
 
-		// check for socket error
-		if(sock.error())
-			throw SessionErrorClosed();
+int Session::get_socket()const{
+	return sock.get_socket();
+}
 
-		// check for exit request
-		if(!running.load())
-			throw SessionErrorExit();
+// set up the next operation, co_await the result to suspend until it completes
+Session::io_wait Session::io(int type,char *buf,unsigned len,int fd,long long offset,const char *head,unsigned head_len){
+	op.type=type;
+	op.buf=buf;
+	op.len=len;
+	op.fd=fd;
+	op.offset=offset;
+	op.head=head;
+	op.head_len=head_len;
+
+	return io_wait{this};
+}
 
-		block[received]=0;
-		req+=block;
+// called whenever the session suspends, there's nothing left to do once Session::serve returns
+void Session::settle(){
+	if(!routine.done())
+		return;
+
+	op.type=SESSION_OP_NONE;
+	routine.rethrow();
+}
+
+// loop and take http requests till the keepalive timer runs out (see Session::expired)
+// errors end the session
+Task Session::serve(){
+	try{
+		// encrypted connections start with the tls handshake
+		if(sock.secure()){
+			if(co_await io(SESSION_OP_HANDSHAKE,NULL,0)<1)
+				throw SessionError("tls handshake failed");
 
-		// end of http request is denoted by CRLFCRLF
-		end=req.find("\r\n\r\n")!=std::string::npos;
+			log(std::string("tls established")+(sock.resumed()?", resumed":"")+(sock.kernel_tls()?", kernel tls":""));
+		}
+
+		for(;;){
+			// get the http request
+			std::string req;
+			co_await get_http_request(req);
+
+			// failures are turned into error pages
+			// (error pages can't be sent from the handlers, coroutines can't suspend in there)
+			int error=0;
+			try{
+				co_await respond(req);
+			}catch(const SessionErrorNotFound &e){
+				// file not found
+				log(e.what());
+				error=HTTP_STATUS_NOT_FOUND;
+			}catch(const SessionErrorForbidden &e){
+				// forbidden file, treat as 404
+				log(e.what());
+				error=HTTP_STATUS_NOT_FOUND;
+			}catch(const SessionErrorMalformed &e){
+				// malformed http request
+				log(e.what());
+				error=HTTP_STATUS_BAD_REQUEST;
+			}catch(const SessionErrorNotSupported &e){
+				// http operation not implemented
+				log(e.what());
+				error=HTTP_STATUS_NOT_IMPLEMENTED;
+			}catch(const SessionErrorVersion &e){
+				// http version not supported
+				log(e.what());
+				error=HTTP_STATUS_VERSION_NOT_SUPPORTED;
+			}catch(const SessionErrorInternal &e){
+				// internal server error
+				log(e.what());
+				error=HTTP_STATUS_INTERNAL_ERROR;
+			}
+
+			if(error==HTTP_STATUS_NOT_FOUND){
+				co_await send_error_not_found();
+				break;
+			}
+			else if(error!=0){
+				co_await send_error_generic(error);
+				break;
+			}
+		}
+	}catch(const SessionError &se){
+		// generic catch-all
+		log(se.what());
 	}
+}
+
+// wait for a complete request and put it in <req>
+Task Session::get_http_request(std::string &req){
+	phase=state::receiving;
+
+	// end of http request is denoted by CRLFCRLF
+	size_t end;
+	while((end=request.find("\r\n\r\n"))==std::string::npos){
+		const int received=co_await io(SESSION_OP_RECV,buffer,buffer_size);
+		if(received<1)
+			throw SessionErrorClosed();
+
+		request.append(buffer,received);
+	}
+
+	// anything after the request belongs to the next one
+	req=request.substr(0,end+4);
+	request.erase(0,end+4);
 
 	// reset the keepalive timeout
 	entry_time=time(NULL);
+	phase=state::sending;
 }
 
-// send a chunk of data
-void Session::send(const char *buf,unsigned size){
-	int sent=0;
-	while(sent!=size){
-		sent+=sock.send_nonblock(buf+sent,size-sent);
-
-		if(sock.error())
-			throw SessionErrorClosed();
-		if(!running.load())
-			throw SessionErrorExit();
+// serve the resource named in <req>
+Task Session::respond(const std::string &req){
+	// make sure it's valid
+	Session::check_http_request(req);
+
+	// get the requested resource name from the request header
+	std::string target;
+	Session::get_target_resource(req,target);
+
+	// compressed, if the client takes that
+	// ranges are always of the file as it is, so they mean the same thing whatever else the client gets
+	std::string value;
+	int encodings=0;
+	if(Session::get_header(req,"accept-encoding",value)&&!Session::get_header(req,"range",value))
+		encodings=Session::get_encodings(value);
+
+	// initialize resource
+	std::unique_ptr<Resource> rc;
+	co_await open(target,rc,encodings);
+	log(std::string("request resource \""+target+"\" (")+rc->type()+(rc->encoding()!=NULL?std::string(", ")+rc->encoding():"")+")");
+
+	// the parts of it that were asked for, if any
+	std::vector<byte_range> ranges;
+	if(!Session::get_ranges(req,rc->size(),ranges)){
+		co_await send_error_range(*rc);
+		co_return;
 	}
+
+	// send the file
+	co_await send_file(*rc,ranges);
 }
 
-int Session::recv(char *buf,unsigned size){
-	return sock.recv_nonblock(buf,size);
+// set up the resource for <target> in <rc>
+// finding, stat'ing and opening it (and reading html files) can block on the disk, so that's a SESSION_OP_DISK
+Task Session::open(const std::string &target,std::unique_ptr<Resource> &rc,int encodings){
+	std::exception_ptr failed;
+	op.disk=[&target,&rc,&failed,encodings](){
+		try{
+			rc.reset(new Resource(target));
+
+			// a compressed variant instead, if there is one
+			if(encodings!=0){
+				std::unique_ptr<Resource> variant=Resource::encoded(*rc,encodings);
+				if(variant)
+					rc=std::move(variant);
+			}
+		}catch(...){
+			failed=std::current_exception();
+		}
+
+		return 1;
+	};
+
+	co_await io(SESSION_OP_DISK,NULL,0);
+	op.disk=nullptr;
+
+	if(failed)
+		std::rethrow_exception(failed);
+}
+
+// send <head> followed by <body>, together where possible
+Task Session::send(const char *head,unsigned head_len,const char *body,unsigned body_len){
+	while(head_len+body_len>0){
+		int result;
+		if(head_len==0)
+			result=co_await io(SESSION_OP_SEND,(char*)body,body_len);
+		else if(body_len==0)
+			result=co_await io(SESSION_OP_SEND,(char*)head,head_len);
+		else
+			result=co_await io(SESSION_OP_SEND,(char*)body,body_len,-1,0,head,head_len);
+		if(result<1)
+			throw SessionErrorClosed();
+
+		// whatever went out came from <head> first
+		unsigned sent=result;
+		if(sent<head_len){
+			head+=sent;
+			head_len-=sent;
+			continue;
+		}
+		sent-=head_len;
+		head_len=0;
+		body+=sent;
+		body_len-=sent;
+	}
 }
 
-void Session::send_file(Resource &rc){
+// send <rc>, or just <ranges> of it (206) if there are any
+Task Session::send_file(Resource &rc,const std::vector<byte_range> &ranges){
 	const long long size=rc.size();
 
-	// construct and send the header
+	// the header goes out together with the start of the body
 	std::string header;
-	Session::construct_response_header(HTTP_STATUS_OK,size,rc.type(),header);
-	send(header.c_str(),header.length());
-
-	// send the body
-	int read=0; // bytes read from rc
-	const int block_size=4096;
-	while(read!=size){
-		// read a block
-		char block[block_size];
-		const int got=rc.get(block,block_size);
-		read+=got;
-
-		// send the block
-		send(block,got);
-
-		if(!running.load())
-			throw SessionErrorExit();
+	char bytes_string[80];
+	if(ranges.empty()&&rc.response()!=NULL){
+		// cached files come with their whole response ready to go
+		const std::string &response=*rc.response();
+		co_await send(response.c_str(),response.length());
+
+		sprintf(bytes_string,"%lld",size);
 	}
+	else if(ranges.empty()){
+		Session::construct_response_header(HTTP_STATUS_OK,size,rc.type(),header,rc.headers());
+		co_await send_body(rc,0,size,header.c_str(),header.length());
 
-	// convert bytes to string
-	char bytes_string[25];
-	sprintf(bytes_string,"%lld",size);
+		sprintf(bytes_string,"%lld",size);
+	}
+	else if(ranges.size()==1){
+		const byte_range &r=ranges[0];
+		sprintf(bytes_string,"bytes %lld-%lld/%lld",r.first,r.last,size);
+
+		Session::construct_response_header(HTTP_STATUS_PARTIAL_CONTENT,r.last-r.first+1,rc.type(),header,std::string(rc.headers())+"Content-Range: "+bytes_string+"\r\n");
+		co_await send_body(rc,r.first,r.last-r.first+1,header.c_str(),header.length());
+
+		sprintf(bytes_string,"%lld-%lld of %lld",r.first,r.last,size);
+	}
+	else{
+		// several ranges go out as parts of a multipart/byteranges body, each with its own little header
+		char boundary[40];
+		sprintf(boundary,"servant%08x%08x",(unsigned)sid,(unsigned)entry_time);
+
+		std::vector<std::string> parts;
+		long long length=0;
+		for(const byte_range &r:ranges){
+			sprintf(bytes_string,"%lld-%lld/%lld",r.first,r.last,size);
+			parts.push_back(std::string("\r\n--")+boundary+"\r\n"
+				"Content-Type: "+rc.type()+"\r\n"
+				"Content-Range: bytes "+bytes_string+"\r\n\r\n");
+
+			length+=parts.back().length()+r.last-r.first+1;
+		}
+		const std::string end=std::string("\r\n--")+boundary+"--\r\n";
+		length+=end.length();
+
+		Session::construct_response_header(HTTP_STATUS_PARTIAL_CONTENT,length,std::string("multipart/byteranges; boundary=")+boundary,header,"Accept-Ranges: bytes\r\n");
+		parts[0]=header+parts[0];
+
+		for(unsigned i=0;i<ranges.size();++i)
+			co_await send_body(rc,ranges[i].first,ranges[i].last-ranges[i].first+1,parts[i].c_str(),parts[i].length());
+		co_await send(end.c_str(),end.length());
+
+		sprintf(bytes_string,"%u ranges, %lld",(unsigned)ranges.size(),length);
+	}
 
 	log(std::string("sent ")+rc.name()+" ("+bytes_string+")");
 }
 
-// send a generic http response error (i.e. with no response body, just the header)
-void Session::send_error_generic(int code){
-	// get status code
-	std::string status;
-	Session::get_status_code(code,status);
+// send <length> bytes of <rc> starting at <offset>, with <head> in front
+Task Session::send_body(Resource &rc,long long offset,long long length,const char *head,unsigned head_len){
+	// tls records are made out here, so mapped files are read for them instead (see Mapping)
+	if(rc.data()!=NULL&&!(sock.secure()&&rc.file()!=-1)){
+		// in memory and mapped resources are sent straight from memory
+		long long sent=0;
+		do{
+			const unsigned chunk=length-sent<SESSION_SENDFILE_CHUNK?length-sent:SESSION_SENDFILE_CHUNK;
+			co_await send(head,head_len,rc.data()+offset+sent,chunk);
+			head_len=0;
+			sent+=chunk;
+		}while(sent!=length);
+	}
+	else{
+		// everything else goes straight from the file to the socket
+		long long sent=0;
+		rc.advance(offset);
+		while(sent!=length||head_len>0){
+			const unsigned chunk=length-sent<SESSION_SENDFILE_CHUNK?length-sent:SESSION_SENDFILE_CHUNK;
+			const int result=co_await io(SESSION_OP_SENDFILE,buffer,chunk,rc.file(),offset+sent,head,head_len);
+			if(result<1){
+				if(head_len>0)
+					throw SessionErrorClosed();
+
+				// too late for an error page, the header is out
+				throw SessionError(std::string("couldn't send ")+rc.name());
+			}
+
+			unsigned got=result;
+			if(got<head_len){
+				head+=got;
+				head_len-=got;
+				continue;
+			}
+			sent+=got-head_len;
+			head_len=0;
+			rc.advance(offset+sent);
+		}
+	}
+}
 
-	// construct body
-	const std::string body=std::string("")+
-		"<!Doctype html>\n"
-		"<html>\n"
-		"<head><title>"+status+"</title></head>\n"
-		"<body>\n"
-		"<h2>"+status+"</h2>\n"
-		"</body>\n"
-		"</html>\n"
-	;
+// none of the ranges asked for are in <rc> (416), say how big it is instead
+Task Session::send_error_range(Resource &rc){
+	char range_string[40];
+	sprintf(range_string,"bytes */%lld",rc.size());
 
-	// construct response header
 	std::string header;
-	Session::construct_response_header(code,body.length(),"text/html",header);
+	Session::construct_response_header(HTTP_STATUS_RANGE_NOT_SATISFIABLE,0,rc.type(),header,std::string("Content-Range: ")+range_string+"\r\n");
+	co_await send(header.c_str(),header.length());
 
-	// send response header
-	send(header.c_str(),header.length());
-	// send body
-	send(body.c_str(),body.length());
+	log(std::string("sent 416 for ")+rc.name()+" ("+range_string+")");
+}
+
+// send a generic http response error (i.e. with no response body, just the header)
+Task Session::send_error_generic(int code){
+	std::string response;
+	const long long bytes=Session::construct_error_response(code,response);
+
+	co_await send(response.c_str(),response.length());
 
 	// convert bytes to string
 	char bytes_string[25];
-	sprintf(bytes_string,"%lld",body.length());
+	sprintf(bytes_string,"%lld",bytes);
 	// convert code to string
 	char code_string[35];
 	sprintf(code_string,"%d",code);
@@ -211,15 +473,19 @@ void Session::send_error_generic(int code){
 }
 
 // send the 404page.html, or a default
-void Session::send_error_not_found(){
+Task Session::send_error_not_found(){
 	// try to send "/404page.html"
+	std::unique_ptr<Resource> rc;
 	try{
-		Resource rc("/404page.html");
-		send_file(rc);
+		co_await open("/404page.html",rc);
 	}catch(const SessionErrorNotFound &e){
 		// no "/404page.html"
-		send_error_generic(HTTP_STATUS_NOT_FOUND);
 	}
+
+	if(rc)
+		co_await send_file(*rc);
+	else
+		co_await send_error_generic(HTTP_STATUS_NOT_FOUND);
 }
 
 void Session::log(const std::string &line)const{
@@ -249,8 +515,34 @@ void Session::check_http_request(const std::string &request){
 		throw SessionErrorVersion();
 }
 
+// put a whole generic error response for <code> (header and a small page) in <response>
+// returns the size of the page
+long long Session::construct_error_response(int code,std::string &response){
+	// get status code
+	std::string status;
+	Session::get_status_code(code,status);
+
+	// construct body
+	const std::string page=std::string("")+
+		"<!Doctype html>\n"
+		"<html>\n"
+		"<head><title>"+status+"</title></head>\n"
+		"<body>\n"
+		"<h2>"+status+"</h2>\n"
+		"</body>\n"
+		"</html>\n"
+	;
+
+	// construct response header, the body goes right after it
+	Session::construct_response_header(code,page.length(),"text/html",response);
+	response+=page;
+
+	return page.length();
+}
+
 // given its parameters, construct the appropriate response header in <header>,
-void Session::construct_response_header(int code,long long content_length,const std::string &type,std::string &header){
+// <extra> is any more header lines (each ending in CRLF)
+void Session::construct_response_header(int code,long long content_length,const std::string &type,std::string &header,const std::string &extra){
 	char length_string[25];
 	sprintf(length_string,"%lld",content_length);
 
@@ -260,6 +552,7 @@ void Session::construct_response_header(int code,long long content_length,const
 	header=std::string("HTTP/1.1 ")+status+"\r\n"+
 	"Content-Length: "+length_string+"\r\n"+
 	"Content-Type: "+type+"\r\n"+
+	extra+
 	"Server: "+DEFAULT_NAME+"\r\n\r\n";
 }
 
@@ -269,15 +562,24 @@ void Session::get_status_code(int code,std::string &status){
 	case HTTP_STATUS_OK:
 		status="200 OK";
 		break;
+	case HTTP_STATUS_PARTIAL_CONTENT:
+		status="206 Partial Content";
+		break;
 	case HTTP_STATUS_BAD_REQUEST:
 		status="400 Bad Request";
 		break;
 	case HTTP_STATUS_NOT_FOUND:
 		status="404 Not Found";
 		break;
+	case HTTP_STATUS_RANGE_NOT_SATISFIABLE:
+		status="416 Range Not Satisfiable";
+		break;
 	case HTTP_STATUS_NOT_IMPLEMENTED:
 		status="501 Not Implemented";
 		break;
+	case HTTP_STATUS_UNAVAILABLE:
+		status="503 Service Unavailable";
+		break;
 	case HTTP_STATUS_VERSION_NOT_SUPPORTED:
 		status="505 HTTP Version Not Supported";
 		break;
@@ -312,3 +614,209 @@ void Session::get_target_resource(const std::string &header,std::string &target)
 	for(char &c:target)
 		c=tolower(c);
 }
+
+// find header field <name> (lowercase, without the colon) in <header> and put its value in <value>
+// returns false if it isn't there
+bool Session::get_header(const std::string &header,const char *name,std::string &value){
+	const size_t name_len=strlen(name);
+
+	// the first line is the request line, fields start after it
+	size_t line=header.find("\r\n");
+	while(line!=std::string::npos&&line+2<header.length()){
+		line+=2;
+		const size_t end=header.find("\r\n",line);
+		if(end==std::string::npos||end==line)
+			break;
+
+		if(end-line>name_len&&header[line+name_len]==':'){
+			bool match=true;
+			for(size_t i=0;i<name_len;++i){
+				if(tolower(header[line+i])!=name[i]){
+					match=false;
+					break;
+				}
+			}
+
+			if(match){
+				size_t begin=line+name_len+1;
+				size_t finish=end;
+				while(begin<finish&&(header[begin]==' '||header[begin]=='\t'))
+					++begin;
+				while(finish>begin&&(header[finish-1]==' '||header[finish-1]=='\t'))
+					--finish;
+
+				value=header.substr(begin,finish-begin);
+				return true;
+			}
+		}
+
+		line=end;
+	}
+
+	return false;
+}
+
+// put the byte ranges of a <size> byte resource asked for in <header> in <ranges>, sorted with overlaps merged
+// <ranges> is left empty for the whole thing: no Range field, one that doesn't make sense, or too many ranges
+// returns false if none of them are in the resource (416)
+bool Session::get_ranges(const std::string &header,long long size,std::vector<byte_range> &ranges){
+	ranges.clear();
+
+	std::string value;
+	if(!Session::get_header(header,"range",value))
+		return true;
+
+	// only bytes
+	std::string unit=value.substr(0,6);
+	for(char &c:unit)
+		c=tolower(c);
+	if(unit!="bytes=")
+		return true;
+
+	bool asked=false; // any ranges at all, satisfiable or not
+	size_t pos=6;
+	while(pos<=value.length()){
+		size_t comma=value.find(',',pos);
+		if(comma==std::string::npos)
+			comma=value.length();
+
+		// trim the spec
+		size_t begin=pos,end=comma;
+		while(begin<end&&value[begin]==' ')
+			++begin;
+		while(end>begin&&value[end-1]==' ')
+			--end;
+		pos=comma+1;
+
+		// empty elements are allowed in the list
+		if(begin==end)
+			continue;
+
+		// pick out the numbers on either side of the dash
+		const size_t dash=value.find('-',begin);
+		if(dash==std::string::npos||dash>=end){
+			ranges.clear();
+			return true;
+		}
+
+		long long numbers[2];
+		bool present[2];
+		const size_t from[2]={begin,dash+1},to[2]={dash,end};
+		for(int i=0;i<2;++i){
+			numbers[i]=0;
+			present[i]=to[i]>from[i];
+			if(to[i]-from[i]>18){
+				ranges.clear();
+				return true;
+			}
+
+			for(size_t j=from[i];j<to[i];++j){
+				if(value[j]<'0'||value[j]>'9'){
+					ranges.clear();
+					return true;
+				}
+				numbers[i]=numbers[i]*10+value[j]-'0';
+			}
+		}
+
+		byte_range r;
+		if(!present[0]){
+			// the last <n> bytes
+			if(!present[1]){
+				ranges.clear();
+				return true;
+			}
+
+			asked=true;
+			if(numbers[1]==0||size==0)
+				continue;
+			r.first=numbers[1]>size?0:size-numbers[1];
+			r.last=size-1;
+		}
+		else{
+			// <first> through <last>, or to the end
+			if(present[1]&&numbers[1]<numbers[0]){
+				ranges.clear();
+				return true;
+			}
+
+			asked=true;
+			if(numbers[0]>=size)
+				continue;
+			r.first=numbers[0];
+			r.last=present[1]&&numbers[1]<size?numbers[1]:size-1;
+		}
+
+		ranges.push_back(r);
+	}
+
+	if(ranges.empty())
+		return !asked;
+
+	// sort them and merge any that overlap or touch
+	std::sort(ranges.begin(),ranges.end(),[](const byte_range &a,const byte_range &b){return a.first<b.first;});
+	unsigned merged=0;
+	for(unsigned i=1;i<ranges.size();++i){
+		if(ranges[i].first<=ranges[merged].last+1){
+			if(ranges[i].last>ranges[merged].last)
+				ranges[merged].last=ranges[i].last;
+		}
+		else
+			ranges[++merged]=ranges[i];
+	}
+	ranges.resize(merged+1);
+
+	if(ranges.size()>SESSION_MAX_RANGES)
+		ranges.clear();
+
+	return true;
+}
+
+// the content codings (ENCODING_* bits) Accept-Encoding field <value> allows, ones it gives a q of 0 are refused
+// "*" stands for every coding the field doesn't name itself
+int Session::get_encodings(const std::string &value){
+	int encodings=0;
+	int named=0; // codings the field names, "*" doesn't cover them
+	bool any=false; // "*" with a q above 0
+
+	size_t begin=0;
+	while(begin<value.length()){
+		size_t end=value.find(',',begin);
+		if(end==std::string::npos)
+			end=value.length();
+
+		// "gzip;q=0.5", other parameters don't matter
+		const size_t semicolon=std::min(value.find(';',begin),end);
+		std::string coding,params;
+		for(size_t i=begin;i<end;++i){
+			if(!isspace(value[i]))
+				(i<semicolon?coding:params)+=tolower(value[i]);
+		}
+
+		double q=1.0;
+		const size_t param=params.find(";q=");
+		if(param!=std::string::npos)
+			q=strtod(params.c_str()+param+3,NULL);
+
+		int bits=0;
+		if(coding=="gzip"||coding=="x-gzip")
+			bits=ENCODING_GZIP;
+		else if(coding=="br")
+			bits=ENCODING_BROTLI;
+		else if(coding=="*")
+			any=q>0.0;
+
+		named|=bits;
+		if(q>0.0)
+			encodings|=bits;
+		else
+			encodings&=~bits;
+
+		begin=end+1;
+	}
+
+	if(any)
+		encodings|=(ENCODING_GZIP|ENCODING_BROTLI)&~named;
+
+	return encodings;
+}
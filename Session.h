@@ -62,34 +62,112 @@ public:
 };
 
 #define HTTP_KEEPALIVE 10
+#define HTTP_SEND_TIMEOUT 30 // seconds a response waits for the peer to take more of it before giving up
+#define SESSION_BUFFER_SIZE 16384 // the session's i/o buffer, also the largest chunk read from disk at a time
+#define SESSION_SENDFILE_CHUNK (1<<30) // most bytes asked for in one SESSION_OP_SENDFILE
+#define SESSION_MAX_RANGES 16 // byte ranges honored in one request, more than that gets the whole file
+
+// the i/o operation a session is waiting on
+#define SESSION_OP_NONE 0 // finished, nothing more to do
+#define SESSION_OP_RECV 1 // receive up to <len> bytes from the socket into <buf>
+#define SESSION_OP_SEND 2 // send <len> bytes from <buf> to the socket
+#define SESSION_OP_SENDFILE 4 // send up to <len> bytes of file <fd> at <offset> to the socket, staged through <buf> (SESSION_BUFFER_SIZE bytes) if need be
+#define SESSION_OP_DISK 5 // run <disk> somewhere it's fine to block on the disk (the owner's disk pool), the result is what it returns
+#define SESSION_OP_HANDSHAKE 6 // carry on with the tls handshake, the result is 1 once it's done
+// sends and sendfiles go out with <head_len> bytes of <head> in front if <head_len> isn't 0, the result counts both
+
+struct session_op{
+	int type;
+	char *buf;
+	unsigned len;
+	int fd;
+	long long offset;
+	const char *head;
+	unsigned head_len;
+	std::function<int()> disk;
+};
+
+// bytes <first> through <last> of a resource, from a Range header
+struct byte_range{
+	long long first;
+	long long last;
+};
 
 class Resource;
 
+// sessions don't do i/o on their own, they describe the next operation they need (Session::operation)
+// and are given its result (Session::complete)
+// the request/response cycle is a coroutine (Session::serve) that suspends on each operation
+// and is resumed by Session::complete
+// Session::handle does the operations directly on the socket as the reactor reports readiness
 class Session{
 public:
-	Session(int,unsigned);
+	Session(net::tcp&&,unsigned,char* = NULL,unsigned = 0);
 	Session(const Session&)=delete;
 	Session(Session&&)=delete;
+	~Session();
 	Session &operator=(const Session&)=delete;
-	static void entry(Servant*,int,unsigned);
+	static long long construct_error_response(int,std::string&);
+	static void construct_response_header(int,long long,const std::string&,std::string&,const std::string& = "");
+	bool handle(int);
+	unsigned blocked()const;
+	const session_op &operation()const;
+	bool complete(int);
+	bool expired(time_t)const;
+	bool idle()const;
+	int interest()const;
+	int get_socket()const;
 
 private:
-	void serve();
-	void get_http_request(std::string&);
-	void send(const char*,unsigned);
-	int recv(char*,unsigned);
-	void send_file(Resource&);
-	void send_error_generic(int);
-	void send_error_not_found();
+	// where the session is in its request/response cycle
+	enum class state{
+		receiving, // waiting for (the rest of) a request
+		sending // transmitting a response
+	};
+
+	// co_await'ed to suspend the session until its operation completes, gives back the result
+	struct io_wait{
+		bool await_ready()const{return false;}
+		void await_suspend(std::coroutine_handle<> h){session->waiting=h;}
+		int await_resume()const{return session->op_result;}
+
+		Session *session;
+	};
+
+	io_wait io(int,char*,unsigned,int = -1,long long = 0,const char* = NULL,unsigned = 0);
+	void settle();
+	Task serve();
+	Task get_http_request(std::string&);
+	Task respond(const std::string&);
+	Task open(const std::string&,std::unique_ptr<Resource>&,int = 0);
+	Task send(const char*,unsigned,const char* = NULL,unsigned = 0);
+	Task send_file(Resource&,const std::vector<byte_range>& = std::vector<byte_range>());
+	Task send_body(Resource&,long long,long long,const char*,unsigned);
+	Task send_error_range(Resource&);
+	Task send_error_generic(int);
+	Task send_error_not_found();
 	void log(const std::string&)const;
 	static void check_http_request(const std::string&);
-	static void construct_response_header(int,long long,const std::string&,std::string&);
 	static void get_status_code(int,std::string&);
 	static void get_target_resource(const std::string&,std::string&);
+	static bool get_header(const std::string&,const char*,std::string&);
+	static bool get_ranges(const std::string&,long long,std::vector<byte_range>&);
+	static int get_encodings(const std::string&);
 
 	net::tcp sock;
 	const int sid; // session id
-	int entry_time;
+	int entry_time; // when the request arrived, or the response last made progress
+	state phase;
+	session_op op; // what the session is waiting on
+	int op_result; // what <op> completed with
+	std::coroutine_handle<> waiting; // the coroutine suspended on <op>
+	Task routine; // Session::serve
+	bool hangup; // peer is done sending
+	unsigned stalls; // sends that would have blocked (the peer's receive window was full), see Session::handle
+	std::unique_ptr<char[]> own_buffer; // backs <buffer> unless one was provided
+	char *buffer; // for receiving requests and reading the body
+	unsigned buffer_size;
+	std::string request; // received bytes not yet processed
 };
 
 #endif // SESSION_H
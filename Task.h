@@ -0,0 +1,76 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+
+// a lazily started coroutine with no result
+// co_await'ing a Task runs it, and resumes the awaiter once it finishes (rethrowing anything it threw)
+// the outermost Task is started with Task::resume
+class Task{
+public:
+	struct promise_type;
+	typedef std::coroutine_handle<promise_type> handle_type;
+
+	struct promise_type{
+		// hand control back to whoever was waiting on this task
+		struct final_awaiter{
+			bool await_ready()noexcept{return false;}
+			std::coroutine_handle<> await_suspend(handle_type h)noexcept{
+				if(h.promise().continuation)
+					return h.promise().continuation;
+
+				return std::noop_coroutine();
+			}
+			void await_resume()noexcept{}
+		};
+
+		Task get_return_object(){return Task(handle_type::from_promise(*this));}
+		std::suspend_always initial_suspend()noexcept{return {};}
+		final_awaiter final_suspend()noexcept{return {};}
+		void return_void(){}
+		void unhandled_exception(){error=std::current_exception();}
+
+		std::coroutine_handle<> continuation;
+		std::exception_ptr error;
+	};
+
+	Task():h(nullptr){}
+	Task(const Task&)=delete;
+	Task(Task &&rhs):h(rhs.h){rhs.h=nullptr;}
+	~Task(){if(h)h.destroy();}
+	Task &operator=(const Task&)=delete;
+	Task &operator=(Task &&rhs){
+		if(h)
+			h.destroy();
+
+		h=rhs.h;
+		rhs.h=nullptr;
+		return *this;
+	}
+
+	bool await_ready()const{return false;}
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter){
+		h.promise().continuation=awaiter;
+		return h;
+	}
+	void await_resume(){
+		if(h.promise().error)
+			std::rethrow_exception(h.promise().error);
+	}
+
+	// start or continue the outermost task
+	void resume(){h.resume();}
+	bool done()const{return !h||h.done();}
+	void rethrow()const{
+		if(h&&h.promise().error)
+			std::rethrow_exception(h.promise().error);
+	}
+
+private:
+	explicit Task(handle_type handle):h(handle){}
+
+	handle_type h;
+};
+
+#endif // TASK_H
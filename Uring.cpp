@@ -0,0 +1,447 @@
+#include "Uring.h"
+
+#ifdef SERVANT_URING
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <algorithm>
+
+static int io_uring_setup(unsigned entries,io_uring_params *p){
+	return syscall(__NR_io_uring_setup,entries,p);
+}
+
+static int io_uring_enter(int fd,unsigned to_submit,unsigned min_complete,unsigned flags){
+	return syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,NULL,0);
+}
+
+static int io_uring_register(int fd,unsigned opcode,const void *arg,unsigned nr_args){
+	return syscall(__NR_io_uring_register,fd,opcode,arg,nr_args);
+}
+
+// <entries> submission entries, <slots> fixed file/registered buffer pairs
+Uring::Uring(unsigned entries,unsigned slots):ringfd(-1),sq_ring(MAP_FAILED),cq_ring(MAP_FAILED),sqes((io_uring_sqe*)MAP_FAILED),queued(0),files_registered(false),buffers_registered(false){
+	// every session can have an operation in flight, leave room for all their completions
+	memset(&params,0,sizeof(params));
+	params.flags=IORING_SETUP_CQSIZE;
+	params.cq_entries=slots*2>entries*2?slots*2:entries*2;
+
+	ringfd=io_uring_setup(entries,&params);
+	if(ringfd==-1)
+		return;
+
+	// map the rings
+	sq_ring_size=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+	cq_ring_size=params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe);
+	if(params.features&IORING_FEAT_SINGLE_MMAP){
+		if(cq_ring_size>sq_ring_size)
+			sq_ring_size=cq_ring_size;
+		cq_ring_size=sq_ring_size;
+	}
+
+	sq_ring=mmap(NULL,sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQ_RING);
+	if(sq_ring==MAP_FAILED){
+		close(ringfd);
+		ringfd=-1;
+		return;
+	}
+
+	if(params.features&IORING_FEAT_SINGLE_MMAP)
+		cq_ring=sq_ring;
+	else
+		cq_ring=mmap(NULL,cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_CQ_RING);
+
+	sqes_size=params.sq_entries*sizeof(io_uring_sqe);
+	sqes=(io_uring_sqe*)mmap(NULL,sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQES);
+	if(cq_ring==MAP_FAILED||sqes==MAP_FAILED){
+		close(ringfd);
+		ringfd=-1;
+		return;
+	}
+
+	char *sq=(char*)sq_ring;
+	sq_head=(unsigned*)(sq+params.sq_off.head);
+	sq_tail=(unsigned*)(sq+params.sq_off.tail);
+	sq_mask=(unsigned*)(sq+params.sq_off.ring_mask);
+	sq_array=(unsigned*)(sq+params.sq_off.array);
+
+	char *cq=(char*)cq_ring;
+	cq_head=(unsigned*)(cq+params.cq_off.head);
+	cq_tail=(unsigned*)(cq+params.cq_off.tail);
+	cq_mask=(unsigned*)(cq+params.cq_off.ring_mask);
+	cqes=(io_uring_cqe*)(cq+params.cq_off.cqes);
+
+	setup_slots(slots);
+}
+
+Uring::~Uring(){
+	if(sqes!=MAP_FAILED)
+		munmap(sqes,sqes_size);
+	if(cq_ring!=MAP_FAILED&&cq_ring!=sq_ring)
+		munmap(cq_ring,cq_ring_size);
+	if(sq_ring!=MAP_FAILED)
+		munmap(sq_ring,sq_ring_size);
+	if(ringfd!=-1)
+		close(ringfd);
+}
+
+bool Uring::operator!()const{
+	return ringfd==-1;
+}
+
+// claim a slot for socket <fd>, returns -1 if they're all taken
+int Uring::acquire(int fd){
+	if(free_slots.empty())
+		return -1;
+
+	const int slot=free_slots.back();
+	free_slots.pop_back();
+
+	if(files_registered){
+		io_uring_files_update update;
+		memset(&update,0,sizeof(update));
+		update.offset=slot;
+		update.fds=(uintptr_t)&fd;
+		io_uring_register(ringfd,IORING_REGISTER_FILES_UPDATE,&update,1);
+	}
+
+	return slot;
+}
+
+// give back a slot, nothing may be in flight on it
+void Uring::release(int slot){
+	if(slot<0)
+		return;
+
+	if(files_registered){
+		const int none=-1;
+
+		io_uring_files_update update;
+		memset(&update,0,sizeof(update));
+		update.offset=slot;
+		update.fds=(uintptr_t)&none;
+		io_uring_register(ringfd,IORING_REGISTER_FILES_UPDATE,&update,1);
+	}
+
+	free_slots.push_back(slot);
+}
+
+// the buffer that belongs to <slot>, URING_SLOT_BUFFER_SIZE bytes
+char *Uring::buffer(int slot)const{
+	return buffers.get()+(size_t)slot*URING_SLOT_BUFFER_SIZE;
+}
+
+// receive into <buf> from socket <fd>, using <slot>'s fixed file and buffer where possible (slot may be -1)
+void Uring::recv(int fd,int slot,char *buf,unsigned len,uint64_t data){
+	io_uring_sqe *sqe=get_sqe(data);
+	if(sqe==NULL)
+		return;
+
+	if(registered_buffer(slot,buf,len)){
+		sqe->opcode=IORING_OP_READ_FIXED;
+		sqe->buf_index=slot;
+	}
+	else
+		sqe->opcode=IORING_OP_RECV;
+
+	if(slot>=0&&files_registered){
+		sqe->fd=slot;
+		sqe->flags|=IOSQE_FIXED_FILE;
+	}
+	else
+		sqe->fd=fd;
+
+	sqe->addr=(uintptr_t)buf;
+	sqe->len=len;
+	sqe->user_data=data;
+}
+
+// send <buf> to socket <fd>, using <slot>'s fixed file and buffer where possible (slot may be -1)
+void Uring::send(int fd,int slot,const char *buf,unsigned len,uint64_t data){
+	io_uring_sqe *sqe=get_sqe(data);
+	if(sqe==NULL)
+		return;
+
+	if(registered_buffer(slot,buf,len)){
+		sqe->opcode=IORING_OP_WRITE_FIXED;
+		sqe->buf_index=slot;
+	}
+	else{
+		sqe->opcode=IORING_OP_SEND;
+		sqe->msg_flags=MSG_NOSIGNAL;
+	}
+
+	if(slot>=0&&files_registered){
+		sqe->fd=slot;
+		sqe->flags|=IOSQE_FIXED_FILE;
+	}
+	else
+		sqe->fd=fd;
+
+	sqe->addr=(uintptr_t)buf;
+	sqe->len=len;
+	sqe->user_data=data;
+}
+
+// send <head> followed by <buf> to socket <fd> in one go, using <slot>'s fixed file (slot may be -1)
+// without a slot there's nowhere to keep the gather list, so only <head> is sent and held back for the rest (MSG_MORE)
+void Uring::send(int fd,int slot,const char *head,unsigned head_len,const char *buf,unsigned len,uint64_t data){
+	if(slot<0){
+		io_uring_sqe *sqe=get_sqe(data);
+		if(sqe==NULL)
+			return;
+
+		sqe->opcode=IORING_OP_SEND;
+		sqe->msg_flags=MSG_NOSIGNAL|MSG_MORE;
+		sqe->fd=fd;
+		sqe->addr=(uintptr_t)head;
+		sqe->len=head_len;
+		sqe->user_data=data;
+		return;
+	}
+
+	gather &g=gathers[slot];
+	g.vec[0].iov_base=(void*)head;
+	g.vec[0].iov_len=head_len;
+	g.vec[1].iov_base=(void*)buf;
+	g.vec[1].iov_len=len;
+	memset(&g.msg,0,sizeof(g.msg));
+	g.msg.msg_iov=g.vec;
+	g.msg.msg_iovlen=2;
+
+	io_uring_sqe *sqe=get_sqe(data);
+	if(sqe==NULL)
+		return;
+
+	sqe->opcode=IORING_OP_SENDMSG;
+	sqe->msg_flags=MSG_NOSIGNAL;
+	if(files_registered){
+		sqe->fd=slot;
+		sqe->flags|=IOSQE_FIXED_FILE;
+	}
+	else
+		sqe->fd=fd;
+
+	sqe->addr=(uintptr_t)&g.msg;
+	sqe->len=1;
+	sqe->user_data=data;
+}
+
+// read file <fd> at <offset> into <buf>, using <slot>'s buffer where possible (slot may be -1)
+void Uring::read(int fd,int slot,char *buf,unsigned len,long long offset,uint64_t data){
+	io_uring_sqe *sqe=get_sqe(data);
+	if(sqe==NULL)
+		return;
+
+	if(registered_buffer(slot,buf,len)){
+		sqe->opcode=IORING_OP_READ_FIXED;
+		sqe->buf_index=slot;
+	}
+	else
+		sqe->opcode=IORING_OP_READ;
+
+	sqe->fd=fd;
+	sqe->off=offset;
+	sqe->addr=(uintptr_t)buf;
+	sqe->len=len;
+	sqe->user_data=data;
+}
+
+// complete once when <fd> becomes readable
+void Uring::poll(int fd,uint64_t data){
+	io_uring_sqe *sqe=get_sqe(data);
+	if(sqe==NULL)
+		return;
+
+	sqe->opcode=IORING_OP_POLL_ADD;
+	sqe->fd=fd;
+	sqe->poll_events=POLLIN;
+	sqe->user_data=data;
+}
+
+// complete after <millis> milliseconds, only one can be pending at a time
+void Uring::timeout(unsigned millis,uint64_t data){
+	wait_time.tv_sec=millis/1000;
+	wait_time.tv_nsec=(millis%1000)*1000000ll;
+
+	io_uring_sqe *sqe=get_sqe(data);
+	if(sqe==NULL)
+		return;
+
+	sqe->opcode=IORING_OP_TIMEOUT;
+	sqe->fd=-1;
+	sqe->addr=(uintptr_t)&wait_time;
+	sqe->len=1;
+	sqe->user_data=data;
+}
+
+// cancel the operation submitted with user data <target>, it completes with -ECANCELED
+void Uring::cancel(uint64_t target,uint64_t data){
+	io_uring_sqe *sqe=get_sqe(data);
+	if(sqe==NULL)
+		return;
+
+	sqe->opcode=IORING_OP_ASYNC_CANCEL;
+	sqe->fd=-1;
+	sqe->addr=target;
+	sqe->user_data=data;
+}
+
+// submit everything queued, wait for at least one completion, fill at most <max> entries in <completions>
+// returns number of entries filled
+int Uring::wait(uring_completion *completions,int max){
+	// ones taken off the ring early go first
+	if(!reaped.empty()){
+		if(queued>0)
+			submit(queued);
+
+		const int count=reaped.size()<(size_t)max?reaped.size():max;
+		std::copy(reaped.begin(),reaped.begin()+count,completions);
+		reaped.erase(reaped.begin(),reaped.begin()+count);
+		return count;
+	}
+
+	unsigned head=*cq_head;
+	if(head==__atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)){
+		// nothing waiting, submit and block
+		const int result=io_uring_enter(ringfd,queued,1,IORING_ENTER_GETEVENTS);
+		if(result>0)
+			queued-=result;
+		if(result==-1)
+			return 0; // interrupted by a signal
+	}
+	else if(queued>0)
+		submit(queued);
+
+	int count=0;
+	const unsigned tail=__atomic_load_n(cq_tail,__ATOMIC_ACQUIRE);
+	while(head!=tail&&count<max){
+		const io_uring_cqe &cqe=cqes[head&*cq_mask];
+		completions[count].data=cqe.user_data;
+		completions[count].result=cqe.res;
+
+		++count;
+		++head;
+	}
+	__atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+
+	return count;
+}
+
+// next free submission entry for an operation with user data <data>, cleared
+// returns NULL if the ring is full and can't be submitted, then the operation completes with the error (see Uring::wait)
+io_uring_sqe *Uring::get_sqe(uint64_t data){
+	// make room if the ring is full
+	// the kernel won't take more (-EBUSY) while completions are piling up, so take them off the ring for Uring::wait
+	while(queued==params.sq_entries){
+		if(submit(queued)>=0||errno==EINTR)
+			continue;
+
+		if(!reap()){
+			uring_completion failed;
+			failed.data=data;
+			failed.result=-errno;
+			reaped.push_back(failed);
+			return NULL;
+		}
+	}
+
+	const unsigned tail=*sq_tail;
+	const unsigned index=tail&*sq_mask;
+
+	io_uring_sqe *sqe=&sqes[index];
+	memset(sqe,0,sizeof(io_uring_sqe));
+
+	sq_array[index]=index;
+	__atomic_store_n(sq_tail,tail+1,__ATOMIC_RELEASE);
+	++queued;
+
+	return sqe;
+}
+
+// hand <count> queued entries to the kernel
+int Uring::submit(unsigned count){
+	const int result=io_uring_enter(ringfd,count,0,0);
+	if(result>0)
+		queued-=result;
+
+	return result;
+}
+
+// move everything on the completion ring to <reaped>, returns false if there was nothing
+bool Uring::reap(){
+	unsigned head=*cq_head;
+	const unsigned tail=__atomic_load_n(cq_tail,__ATOMIC_ACQUIRE);
+	if(head==tail)
+		return false;
+
+	while(head!=tail){
+		const io_uring_cqe &cqe=cqes[head&*cq_mask];
+		uring_completion c;
+		c.data=cqe.user_data;
+		c.result=cqe.res;
+		reaped.push_back(c);
+
+		++head;
+	}
+	__atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+
+	return true;
+}
+
+// allocate and register the buffers and fixed files for <slots> slots
+// if registration fails, the slots still work with regular files and buffers
+void Uring::setup_slots(unsigned slots){
+	if(slots==0)
+		return;
+
+	buffers.reset(new char[(size_t)slots*URING_SLOT_BUFFER_SIZE]);
+	gathers.reset(new gather[slots]);
+
+	std::vector<iovec> iovecs(slots);
+	std::vector<int> fds(slots,-1);
+	for(unsigned i=0;i<slots;++i){
+		iovecs[i].iov_base=buffer(i);
+		iovecs[i].iov_len=URING_SLOT_BUFFER_SIZE;
+	}
+
+	buffers_registered=io_uring_register(ringfd,IORING_REGISTER_BUFFERS,&iovecs[0],slots)==0;
+	files_registered=io_uring_register(ringfd,IORING_REGISTER_FILES,&fds[0],slots)==0;
+
+	// hand out low slots first
+	for(unsigned i=slots;i>0;--i)
+		free_slots.push_back(i-1);
+}
+
+// whether <buf> lies within <slot>'s registered buffer
+bool Uring::registered_buffer(int slot,const char *buf,unsigned len)const{
+	if(slot<0||!buffers_registered)
+		return false;
+
+	const char *start=buffer(slot);
+	return buf>=start&&buf+len<=start+URING_SLOT_BUFFER_SIZE;
+}
+
+#else
+
+// no io_uring here
+Uring::Uring(unsigned,unsigned){}
+Uring::~Uring(){}
+bool Uring::operator!()const{return true;}
+int Uring::acquire(int){return -1;}
+void Uring::release(int){}
+char *Uring::buffer(int)const{return NULL;}
+void Uring::recv(int,int,char*,unsigned,uint64_t){}
+void Uring::send(int,int,const char*,unsigned,uint64_t){}
+void Uring::send(int,int,const char*,unsigned,const char*,unsigned,uint64_t){}
+void Uring::read(int,int,char*,unsigned,long long,uint64_t){}
+void Uring::poll(int,uint64_t){}
+void Uring::timeout(unsigned,uint64_t){}
+void Uring::cancel(uint64_t,uint64_t){}
+int Uring::wait(uring_completion*,int){return 0;}
+
+#endif // SERVANT_URING
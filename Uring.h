@@ -0,0 +1,94 @@
+#ifndef URING_H
+#define URING_H
+
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+#if defined(__linux__)&&defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SERVANT_URING
+#endif
+#endif
+
+#ifdef SERVANT_URING
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif // SERVANT_URING
+
+#define URING_SLOT_BUFFER_SIZE 16384 // size of each registered buffer
+
+struct uring_completion{
+	uint64_t data; // user data the operation was submitted with
+	int result; // bytes transferred or -errno
+};
+
+// minimal io_uring: operations are queued in the submission ring and
+// submitted in one go the next time Uring::wait is called
+// each slot pairs a registered ("fixed") file with a registered buffer
+// everything fails (operator! is true) on systems without io_uring
+class Uring{
+public:
+	Uring(unsigned,unsigned);
+	Uring(const Uring&)=delete;
+	Uring(Uring&&)=delete;
+	~Uring();
+	Uring &operator=(const Uring&)=delete;
+	bool operator!()const;
+	int acquire(int);
+	void release(int);
+	char *buffer(int)const;
+	void recv(int,int,char*,unsigned,uint64_t);
+	void send(int,int,const char*,unsigned,uint64_t);
+	void send(int,int,const char*,unsigned,const char*,unsigned,uint64_t);
+	void read(int,int,char*,unsigned,long long,uint64_t);
+	void poll(int,uint64_t);
+	void timeout(unsigned,uint64_t);
+	void cancel(uint64_t,uint64_t);
+	int wait(uring_completion*,int);
+
+private:
+#ifdef SERVANT_URING
+	// backs a slot's gathered send while it's in flight
+	struct gather{
+		msghdr msg;
+		iovec vec[2];
+	};
+
+	io_uring_sqe *get_sqe(uint64_t);
+	int submit(unsigned);
+	bool reap();
+	void setup_slots(unsigned);
+	bool registered_buffer(int,const char*,unsigned)const;
+
+	int ringfd;
+	io_uring_params params;
+	void *sq_ring; // mapped submission ring
+	void *cq_ring; // mapped completion ring, may be the same as <sq_ring>
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	io_uring_sqe *sqes; // mapped submission entries
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	io_uring_cqe *cqes;
+	unsigned queued; // entries filled in but not yet submitted
+	__kernel_timespec wait_time; // backs the pending timeout operation
+
+	std::unique_ptr<char[]> buffers; // all the registered buffers, URING_SLOT_BUFFER_SIZE each
+	std::unique_ptr<gather[]> gathers; // one per slot
+	bool files_registered;
+	bool buffers_registered;
+	std::vector<int> free_slots;
+	std::vector<uring_completion> reaped; // completions taken off the ring, and operations that couldn't be submitted, for Uring::wait
+#endif // SERVANT_URING
+};
+
+#endif // URING_H
@@ -0,0 +1,232 @@
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <errno.h>
+
+#include "Servant.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define WATCH_EVENTS (IN_MODIFY|IN_CLOSE_WRITE|IN_ATTRIB|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR|IN_DONT_FOLLOW)
+
+Watcher::Watcher():notify(-1),rescan(false){
+	stop_pipe[0]=-1;
+	stop_pipe[1]=-1;
+}
+
+Watcher::~Watcher(){
+	if(thread.joinable()){
+		const char stop=0;
+		if(write(stop_pipe[1],&stop,1)==1)
+			thread.join();
+		else
+			thread.detach();
+	}
+
+	for(int fd:stop_pipe){
+		if(fd!=-1)
+			close(fd);
+	}
+	if(notify!=-1)
+		close(notify);
+}
+
+// have <l> called with each batch of changes, from the watcher's thread
+// only before Watcher::start
+void Watcher::subscribe(listener l){
+	listeners.push_back(l);
+}
+
+// start watching directory <dir> and everything under it
+// returns false if it can't be watched
+bool Watcher::start(const std::string &dir){
+	root=dir;
+
+	notify=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if(notify==-1)
+		return false;
+	if(pipe2(stop_pipe,O_CLOEXEC))
+		return false;
+
+	watch_tree("");
+	if(dirs.empty())
+		return false;
+
+	thread=std::thread(&Watcher::run,this);
+	return true;
+}
+
+void Watcher::run(){
+	typedef std::chrono::steady_clock clock;
+	clock::time_point first; // of the pending changes
+	clock::time_point last;
+
+	for(;;){
+		// wait for more changes, or for the pending ones to settle down
+		int timeout=-1;
+		if(!pending.empty()||rescan){
+			const clock::time_point now=clock::now();
+			const long long settle=WATCH_SETTLE-std::chrono::duration_cast<std::chrono::milliseconds>(now-last).count();
+			const long long held=WATCH_MAX_DELAY-std::chrono::duration_cast<std::chrono::milliseconds>(now-first).count();
+			timeout=std::max(0LL,std::min(settle,held));
+		}
+
+		pollfd fds[2]={{notify,POLLIN,0},{stop_pipe[0],POLLIN,0}};
+		const int ready=poll(fds,2,timeout);
+		if(ready==-1&&errno!=EINTR)
+			return;
+		if(ready>0&&fds[1].revents!=0)
+			return;
+
+		if(ready>0&&(fds[0].revents&POLLIN)){
+			const bool settled=pending.empty()&&!rescan;
+			read_events();
+
+			last=clock::now();
+			if(settled)
+				first=last;
+		}
+
+		if(pending.empty()&&!rescan)
+			continue;
+
+		const clock::time_point now=clock::now();
+		if(now-last>=std::chrono::milliseconds(WATCH_SETTLE)||now-first>=std::chrono::milliseconds(WATCH_MAX_DELAY))
+			publish();
+	}
+}
+
+// take in everything inotify has to say
+void Watcher::read_events(){
+	alignas(inotify_event) char buffer[16384];
+
+	for(;;){
+		const int len=read(notify,buffer,sizeof(buffer));
+		if(len<1)
+			return;
+
+		for(int pos=0;pos<len;){
+			const inotify_event *event=(const inotify_event*)(buffer+pos);
+			pos+=sizeof(inotify_event)+event->len;
+
+			// events were lost
+			if(event->mask&IN_Q_OVERFLOW){
+				rescan=true;
+				continue;
+			}
+
+			auto dir=dirs.find(event->wd);
+			if(dir==dirs.end())
+				continue;
+
+			// the directory is gone, or isn't watched anymore
+			if(event->mask&IN_IGNORED){
+				dirs.erase(dir);
+				continue;
+			}
+
+			// only events for something in the directory have a name, the directory's own are reported by its parent
+			if(event->len==0)
+				continue;
+
+			const std::string path=dir->second.empty()?std::string(event->name):dir->second+"/"+event->name;
+			if(event->mask&(IN_CREATE|IN_MOVED_TO)){
+				if(event->mask&IN_ISDIR)
+					watch_tree(path);
+				note(path,FILE_ADDED);
+			}
+			else if(event->mask&(IN_DELETE|IN_MOVED_FROM)){
+				if(event->mask&IN_ISDIR)
+					forget_tree(path);
+				note(path,FILE_REMOVED);
+			}
+			else
+				note(path,FILE_CHANGED);
+		}
+	}
+}
+
+// watch directory <path> (relative to <root>) and the directories under it
+// anything that isn't a directory, symlinks included, is left alone
+void Watcher::watch_tree(const std::string &path){
+	const std::string full=path.empty()?root:root+"/"+path;
+
+	const int wd=inotify_add_watch(notify,full.c_str(),WATCH_EVENTS);
+	if(wd==-1){
+		if(errno==ENOSPC)
+			std::cout<<"warning: can't watch \""<<full<<"\" for changes, out of inotify watches (fs.inotify.max_user_watches)"<<std::endl;
+		return;
+	}
+	dirs[wd]=path;
+
+	std::vector<std::string> names;
+	if(!list_directory(full,names))
+		return;
+
+	for(const std::string &name:names)
+		watch_tree(path.empty()?name:path+"/"+name);
+}
+
+// stop watching directory <path> and everything under it, it's been moved out or deleted
+void Watcher::forget_tree(const std::string &path){
+	for(auto it=dirs.begin();it!=dirs.end();){
+		if(it->second==path||it->second.compare(0,path.length()+1,path+"/")==0){
+			inotify_rm_watch(notify,it->first);
+			it=dirs.erase(it);
+		}
+		else
+			++it;
+	}
+}
+
+// remember that <kind> happened to <path>, until the next batch goes out
+void Watcher::note(const std::string &path,int kind){
+	auto it=pending.find(path);
+	if(it==pending.end())
+		pending[path]=kind;
+	else if(!(it->second==FILE_ADDED&&kind==FILE_CHANGED)) // changed after being added is still new
+		it->second=kind;
+}
+
+// hand the pending changes to the listeners
+void Watcher::publish(){
+	std::vector<file_change> batch;
+	if(rescan){
+		// directories made while events were being lost aren't watched yet
+		watch_tree("");
+		batch.push_back({"",FILE_RESCAN});
+	}
+	else{
+		for(const auto &change:pending)
+			batch.push_back({change.first,change.second});
+	}
+
+	pending.clear();
+	rescan=false;
+
+	for(const listener &l:listeners)
+		l(batch);
+}
+
+#else
+
+// no inotify here
+Watcher::Watcher():notify(-1),rescan(false){
+	stop_pipe[0]=-1;
+	stop_pipe[1]=-1;
+}
+Watcher::~Watcher(){}
+void Watcher::subscribe(listener l){listeners.push_back(l);}
+bool Watcher::start(const std::string&){return false;}
+void Watcher::run(){}
+void Watcher::read_events(){}
+void Watcher::watch_tree(const std::string&){}
+void Watcher::forget_tree(const std::string&){}
+void Watcher::note(const std::string&,int){}
+void Watcher::publish(){}
+
+#endif // __linux__
@@ -0,0 +1,60 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+
+#define WATCH_SETTLE 100 // milliseconds without changes before they're published
+#define WATCH_MAX_DELAY 1000 // milliseconds changes are held back at most, when they keep coming
+
+// what happened to a file, see file_change
+#define FILE_CHANGED 1 // contents or attributes
+#define FILE_ADDED 2 // created, or moved in
+#define FILE_REMOVED 3 // deleted, or moved out
+#define FILE_RESCAN 4 // too much happened to keep track of, anything may have changed (<path> is empty)
+
+// a change to something under the watched directory
+struct file_change{
+	std::string path; // relative to the watched directory, like "about/index.html"
+	int kind; // FILE_*
+};
+
+// watches a directory tree for changes from a thread of its own, and tells the listeners about them
+// changes are coalesced, a burst of them (a deploy) goes out as one batch once things settle down
+// each path is in a batch once, with what ended up happening to it
+// symlinks aren't followed. linux only, Watcher::start fails elsewhere
+class Watcher{
+public:
+	typedef std::function<void(const std::vector<file_change>&)> listener;
+
+	Watcher();
+	Watcher(const Watcher&)=delete;
+	Watcher(Watcher&&)=delete;
+	~Watcher();
+	Watcher &operator=(const Watcher&)=delete;
+	void subscribe(listener);
+	bool start(const std::string&);
+
+private:
+	void run();
+	void read_events();
+	void watch_tree(const std::string&);
+	void forget_tree(const std::string&);
+	void note(const std::string&,int);
+	void publish();
+
+	int notify; // inotify descriptor
+	int stop_pipe[2]; // written to stop <thread>
+	std::string root;
+	std::vector<listener> listeners; // only changed before Watcher::start
+	std::unordered_map<int,std::string> dirs; // watched directories by watch descriptor, relative to <root>
+	std::map<std::string,int> pending; // changes not published yet, path to FILE_*
+	bool rescan; // publish FILE_RESCAN instead of <pending>
+	std::thread thread;
+};
+
+#endif // WATCHER_H
@@ -0,0 +1,111 @@
+#include <string>
+
+#include "WorkerPool.h"
+#include "os.h"
+
+// the pool and run queue the current thread works for, if any
+static thread_local const WorkerPool *current_pool=NULL;
+static thread_local unsigned current_queue=0;
+
+// <count> workers, pinned to <cpus> unless it's empty
+WorkerPool::WorkerPool(unsigned count,const std::vector<unsigned> &cpus):next(0),queued(0),stop(false){
+	if(count==0)
+		count=1;
+
+	for(unsigned i=0;i<count;++i)
+		queues.push_back(std::unique_ptr<run_queue>(new run_queue));
+
+	for(unsigned i=0;i<count;++i)
+		threads.push_back(std::thread(&WorkerPool::run,this,i,cpus));
+}
+
+// finishes all queued tasks before returning
+WorkerPool::~WorkerPool(){
+	{
+		std::lock_guard<std::mutex> lock(idle_lock);
+		stop=true;
+	}
+	idle.notify_all();
+
+	for(std::thread &t:threads)
+		t.join();
+}
+
+// queue a task to be run on one of the workers
+void WorkerPool::submit(task t){
+	// tasks submitted by a worker stay with that worker (unless stolen), others are spread out
+	unsigned index;
+	if(current_pool==this)
+		index=current_queue;
+	else
+		index=next++%queues.size();
+
+	{
+		run_queue &q=*queues[index];
+		std::lock_guard<std::mutex> lock(q.mut);
+		q.tasks.push_back(std::move(t));
+	}
+
+	++queued;
+
+	std::lock_guard<std::mutex> lock(idle_lock);
+	idle.notify_one();
+}
+
+unsigned WorkerPool::size()const{
+	return threads.size();
+}
+
+// worker thread entry point
+void WorkerPool::run(unsigned index,std::vector<unsigned> cpus){
+	if(!cpus.empty())
+		pin_thread(cpus);
+
+	current_pool=this;
+	current_queue=index;
+
+	for(;;){
+		task t;
+		if(pop(index,t)||steal(index,t)){
+			--queued;
+			t();
+			continue;
+		}
+
+		// nothing to do anywhere, sleep until something is submitted
+		std::unique_lock<std::mutex> lock(idle_lock);
+		idle.wait(lock,[this]{return stop||queued.load()>0;});
+
+		if(stop&&queued.load()==0)
+			return;
+	}
+}
+
+// take the most recently submitted task from worker <index>'s own queue
+bool WorkerPool::pop(unsigned index,task &t){
+	run_queue &q=*queues[index];
+	std::lock_guard<std::mutex> lock(q.mut);
+	if(q.tasks.empty())
+		return false;
+
+	t=std::move(q.tasks.back());
+	q.tasks.pop_back();
+	return true;
+}
+
+// take the oldest task from some other worker's queue
+bool WorkerPool::steal(unsigned index,task &t){
+	const unsigned count=queues.size();
+	for(unsigned i=1;i<count;++i){
+		run_queue &q=*queues[(index+i)%count];
+		std::lock_guard<std::mutex> lock(q.mut);
+		if(q.tasks.empty())
+			continue;
+
+		t=std::move(q.tasks.front());
+		q.tasks.pop_front();
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,48 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// fixed set of threads running submitted tasks
+// each worker has its own run queue, idle workers steal from the others
+// workers can be pinned to a set of cpus
+class WorkerPool{
+public:
+	typedef std::function<void()> task;
+
+	WorkerPool(unsigned,const std::vector<unsigned>& = std::vector<unsigned>());
+	WorkerPool(const WorkerPool&)=delete;
+	WorkerPool(WorkerPool&&)=delete;
+	~WorkerPool();
+	WorkerPool &operator=(const WorkerPool&)=delete;
+	void submit(task);
+	unsigned size()const;
+
+private:
+	// a worker's run queue
+	struct run_queue{
+		std::deque<task> tasks;
+		std::mutex mut;
+	};
+
+	void run(unsigned,std::vector<unsigned>);
+	bool pop(unsigned,task&);
+	bool steal(unsigned,task&);
+
+	std::vector<std::unique_ptr<run_queue>> queues;
+	std::vector<std::thread> threads;
+	std::atomic<unsigned> next; // round robin for submissions from outside the pool
+	std::atomic<unsigned> queued; // tasks submitted but not yet picked up
+	std::mutex idle_lock; // protects <stop>, used with <idle>
+	std::condition_variable idle; // idle workers sleep on this
+	bool stop;
+};
+
+#endif // WORKERPOOL_H
@@ -2,6 +2,7 @@
 #include <atomic>
 #include <thread>
 #include <chrono>
+#include <cstdlib>
 
 #include "Servant.h"
 #ifdef _WIN32
@@ -11,6 +12,38 @@
 #endif // _WIN32
 
 std::atomic<bool> running;
+static std::atomic<bool> stuck(false); // a shard couldn't get all its sessions back, see Servant::finish
+
+// run a Servant until exit is requested, on <cpus> unless it's empty
+static void shard(Servant *servant,const std::vector<unsigned> &cpus){
+	if(!cpus.empty())
+		pin_thread(cpus);
+
+	while(running.load()){
+		servant->wait();
+	}
+
+	// SIGTERM lets in-flight responses finish
+	const time_t deadline=time(NULL)+DRAIN_TIMEOUT;
+	if(graceful_shutdown())
+		servant->drain(DRAIN_TIMEOUT);
+
+	// sessions still out on the pools get whatever is left of that
+	const time_t now=time(NULL);
+	if(!servant->finish(now+1<deadline?deadline-now:1))
+		stuck.store(true);
+}
+
+// the cpus shard <index> of <count> runs on
+// a contiguous run of <cpus>, so it stays within one numa node where possible
+static std::vector<unsigned> shard_cpus(const std::vector<unsigned> &cpus,unsigned count,unsigned index){
+	if(count>=cpus.size())
+		return std::vector<unsigned>(1,cpus[index%cpus.size()]);
+
+	const unsigned begin=index*cpus.size()/count;
+	const unsigned end=(index+1)*cpus.size()/count;
+	return std::vector<unsigned>(cpus.begin()+begin,cpus.begin()+end);
+}
 
 int main(int argc,char **argv){
 	running.store(true);
@@ -21,16 +54,73 @@ int main(int argc,char **argv){
 	// figure out cmd options
 	config cfg;
 	cmdline(cfg,argc,argv);
+	Resource::map_files(cfg.mapped);
+	Resource::stream_files(cfg.stream_policy,cfg.stream_size);
+	Resource::cache_files(cfg.cache_size);
 
 	// new unnamed scope
 	{
-		// initialize the server
-		Servant servant(cfg.port);
-		if(!servant){
-			std::cout<<"error: could not bind to port "<<cfg.port<<std::endl;
-			return 1;
+		// make sure io_uring works before going any further
+		if(cfg.uring){
+			Uring probe(1,0);
+			if(!probe){
+				std::cout<<"error: io_uring is not available"<<std::endl;
+				return 1;
+			}
+		}
+
+		// with more than one shard, each one is pinned to its own set of cpus
+		// (the main thread moves between them while setting the shards up, <cpus> puts it back after)
+		std::vector<std::vector<unsigned>> shard_sets(cfg.shards);
+		const std::vector<unsigned> cpus=cpu_list();
+		if(cfg.shards>1){
+			for(unsigned i=0;i<cfg.shards;++i)
+				shard_sets[i]=shard_cpus(cpus,cfg.shards,i);
+		}
+
+		// initialize the server, one listener per shard all sharing the port
+		// each shard has its own workers on its own cpus (the threads are split between them),
+		// sessions are handled on the shard threads if -t 0 was given or with the io_uring backend
+		// https settings are shared by all shards
+		std::unique_ptr<net::tls_context> tls;
+		if(!cfg.cert.empty()){
+			if(cfg.uring){
+				std::cout<<"error: https needs the epoll backend"<<std::endl;
+				return 1;
+			}
+
+			tls.reset(new net::tls_context(cfg.cert,cfg.key.empty()?cfg.cert:cfg.key));
+			if(!*tls){
+				std::cout<<"error: could not set up https with \""<<cfg.cert<<"\" and \""<<cfg.key<<"\" (or servant was built without tls)"<<std::endl;
+				return 1;
+			}
+		}
+
+		// disk i/o is done on its own pool shared by all shards, so slow storage only holds up the sessions waiting on it
+		std::unique_ptr<WorkerPool> disk(cfg.disk_threads>0?new WorkerPool(cfg.disk_threads):NULL);
+
+		std::vector<std::unique_ptr<WorkerPool>> pools;
+		std::vector<std::unique_ptr<Servant>> shards;
+		for(unsigned i=0;i<cfg.shards;++i){
+			// memory is allocated local to the cpu that first touches it,
+			// so set up each shard from its own cpus
+			if(!shard_sets[i].empty())
+				pin_thread(shard_sets[i]);
+
+			const unsigned threads=cfg.threads/cfg.shards+(i<cfg.threads%cfg.shards?1:0);
+			pools.push_back(std::unique_ptr<WorkerPool>(threads>0&&!cfg.uring?new WorkerPool(threads,shard_sets[i]):NULL));
+
+			shards.push_back(std::unique_ptr<Servant>(new Servant(cfg,pools.back().get(),disk.get(),tls.get(),shard_sets[i].empty()?-1:(int)shard_sets[i][0])));
+			if(!*shards.back()){
+				std::cout<<"error: could not bind to port "<<cfg.port<<std::endl;
+				return 1;
+			}
 		}
 
+		// threads started from here on (the watcher, the compressor) aren't tied to the last shard's cpus
+		if(cfg.shards>1)
+			pin_thread(cpus);
+
 		// drop root priviledges if requested
 		if(cfg.uid!=0){
 			if(!drop_root(cfg.uid)){
@@ -39,16 +129,77 @@ int main(int argc,char **argv){
 		}
 
 		// chdir to <cfg.rootdir>
-		if(!working_dir(cfg.root)){
+		if(!working_dir(cfg.root)||!Resource::serve_current_dir()){
 			std::cout<<"error: could not find directory \""<<cfg.root<<"\""<<std::endl;
 			return 1;
 		}
 
+		// know where everything is before the first request
+		if(cfg.index){
+			const auto start=std::chrono::steady_clock::now();
+			const unsigned indexed=Resource::index_files();
+			const long long millis=std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-start).count();
+			std::cout<<"[indexed '"<<indexed<<"' paths under '"<<cfg.root<<"' in '"<<millis<<"' ms]"<<std::endl;
+		}
+
+		// and hear about it when that changes
+		std::unique_ptr<Watcher> watcher;
+		if(cfg.watch){
+			watcher.reset(new Watcher);
+			Resource::watch_files(*watcher);
+			if(!watcher->start(".")){
+				std::cout<<"error: could not watch \""<<cfg.root<<"\" for changes"<<std::endl;
+				return 1;
+			}
+		}
+
+		// compressed variants are made in the background, requests get the uncompressed files until they're ready
+		std::thread compressor;
+		if(cfg.compress){
+			if(compressors()==0){
+				std::cout<<"error: servant was built without zlib or brotli, it can't compress files"<<std::endl;
+				return 1;
+			}
+
+			compressor=std::thread([&cfg](){
+				const auto start=std::chrono::steady_clock::now();
+				const unsigned written=Resource::compress_files();
+				const long long millis=std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-start).count();
+				std::cout<<"[compressed '"<<written<<"' variants under '"<<cfg.root<<"' in '"<<millis<<"' ms]"<<std::endl;
+			});
+		}
+
 		// print status line
-		std::cout<<"[document root: '"<<cfg.root<<"' -- port: '"<<cfg.port<<"' -- ready]"<<std::endl;
+		std::cout<<"[document root: '"<<cfg.root<<"' -- port: '"<<cfg.port<<"' -- threads: '"<<cfg.threads<<"' -- disk threads: '"<<cfg.disk_threads<<"' -- shards: '"<<cfg.shards<<"' -- io: '"<<(cfg.uring?"io_uring":"epoll")<<"' -- "<<(tls?"https":"http")<<" -- ready]"<<std::endl;
+
+		// each shard gets its own thread, the first one runs here
+		std::vector<std::thread> threads;
+		for(unsigned i=1;i<shards.size();++i)
+			threads.push_back(std::thread(shard,shards[i].get(),std::cref(shard_sets[i])));
+
+		shard(shards[0].get(),shard_sets[0]);
+
+		for(std::thread &t:threads)
+			t.join();
+		if(compressor.joinable())
+			compressor.join();
+
+		// totals across the shards
+		unsigned long long rejected=0,blocked=0;
+		for(const std::unique_ptr<Servant> &s:shards){
+			const servant_counts c=s->counts();
+			rejected+=c.rejected;
+			blocked+=c.blocked;
+		}
+		const stream_counts streamed=Resource::streamed();
+		const cache_counts cached=Resource::cached();
+		std::cout<<"[rejected: '"<<rejected<<"' -- sends that waited on slow peers: '"<<blocked<<"' -- streamed files: '"<<streamed.files<<"' -- read ahead: '"<<streamed.readahead<<"' -- dropped: '"<<streamed.dropped<<"']"<<std::endl;
+		std::cout<<"[cache hits: '"<<cached.hits<<"' -- misses: '"<<cached.misses<<"' -- evictions: '"<<cached.evictions<<"' -- cached files: '"<<cached.files<<"' -- cached bytes: '"<<cached.bytes<<"']"<<std::endl;
 
-		while(running.load()){
-			servant.accept();
+		// the shards and the pools can't be torn down under sessions that never came back, leave them to the os (which closes their sockets)
+		if(stuck.load()){
+			std::cout<<"exiting without the sessions stuck on the disk..."<<std::endl;
+			std::_Exit(0);
 		}
 	}
 
@@ -63,10 +214,24 @@ void cmdline(config &cfg,int argc,char **argv){
 	cfg.port=DEFAULT_PORT;
 	cfg.root=DEFAULT_ROOTDIR;
 	cfg.uid=0;
+	cfg.threads=cpu_count();
+	cfg.disk_threads=DEFAULT_DISK_THREADS;
+	cfg.shards=DEFAULT_SHARDS;
+	cfg.uring=false;
+	cfg.max_sessions=DEFAULT_MAX_SESSIONS;
+	cfg.max_pending=DEFAULT_MAX_PENDING;
+	cfg.steer=false;
+	cfg.mapped=false;
+	cfg.stream_policy=STREAM_SEQUENTIAL;
+	cfg.stream_size=DEFAULT_STREAM_SIZE;
+	cfg.cache_size=DEFAULT_CACHE_SIZE;
+	cfg.index=false;
+	cfg.watch=false;
+	cfg.compress=false;
 
 	opterr=1;
 	int c;
-	while((c=getopt(argc,argv,"p:r:u:h"))!=-1){
+	while((c=getopt(argc,argv,"p:r:u:t:d:s:i:m:q:b:f:z:a:e:k:xwgch"))!=-1){
 		switch(c){
 		case 'p': // port (-p)
 			if(1!=sscanf(optarg,"%hu",&cfg.port))
@@ -79,6 +244,78 @@ void cmdline(config &cfg,int argc,char **argv){
 			if(1!=sscanf(optarg,"%u",&cfg.uid))
 				usage(argv[0]);
 			break;
+		case 't': // worker threads (-t)
+			if(1!=sscanf(optarg,"%u",&cfg.threads))
+				usage(argv[0]);
+			break;
+		case 'd': // disk threads (-d)
+			if(1!=sscanf(optarg,"%u",&cfg.disk_threads))
+				usage(argv[0]);
+			break;
+		case 's': // shards (-s)
+			if(1!=sscanf(optarg,"%u",&cfg.shards)||cfg.shards==0)
+				usage(argv[0]);
+			break;
+		case 'i': // io backend (-i)
+			if(!strcmp(optarg,"uring"))
+				cfg.uring=true;
+			else if(!strcmp(optarg,"epoll"))
+				cfg.uring=false;
+			else
+				usage(argv[0]);
+			break;
+		case 'm': // max sessions (-m)
+			if(1!=sscanf(optarg,"%u",&cfg.max_sessions))
+				usage(argv[0]);
+			break;
+		case 'q': // max pending (-q)
+			if(1!=sscanf(optarg,"%u",&cfg.max_pending))
+				usage(argv[0]);
+			break;
+		case 'b': // body source (-b)
+			if(!strcmp(optarg,"mmap"))
+				cfg.mapped=true;
+			else if(!strcmp(optarg,"sendfile"))
+				cfg.mapped=false;
+			else
+				usage(argv[0]);
+			break;
+		case 'f': // streaming policy (-f)
+			if(!strcmp(optarg,"none"))
+				cfg.stream_policy=STREAM_NONE;
+			else if(!strcmp(optarg,"sequential"))
+				cfg.stream_policy=STREAM_SEQUENTIAL;
+			else if(!strcmp(optarg,"dropbehind"))
+				cfg.stream_policy=STREAM_DROPBEHIND;
+			else
+				usage(argv[0]);
+			break;
+		case 'z': // stream size (-z)
+			if(1!=sscanf(optarg,"%lld",&cfg.stream_size)||cfg.stream_size<0)
+				usage(argv[0]);
+			break;
+		case 'a': // cache size (-a)
+			if(1!=sscanf(optarg,"%lld",&cfg.cache_size)||cfg.cache_size<0)
+				usage(argv[0]);
+			break;
+		case 'e': // certificate (-e)
+			cfg.cert=optarg;
+			break;
+		case 'k': // private key (-k)
+			cfg.key=optarg;
+			break;
+		case 'x': // index the document root (-x)
+			cfg.index=true;
+			break;
+		case 'w': // watch the document root (-w)
+			cfg.watch=true;
+			break;
+		case 'g': // generate compressed variants (-g)
+			cfg.compress=true;
+			break;
+		case 'c': // steer connections to shards by cpu (-c)
+			cfg.steer=true;
+			break;
 		case 'h':
 		case '?':
 			usage(argv[0]);
@@ -88,10 +325,25 @@ void cmdline(config &cfg,int argc,char **argv){
 }
 
 void usage(const char *name){
-	std::cout<<"usage: "<<name<<" [-u uid] [-p port] [-r rootdir] [-h]"<<std::endl;
+	std::cout<<"usage: "<<name<<" [-u uid] [-p port] [-r rootdir] [-t threads] [-d disk_threads] [-s shards] [-i epoll|uring] [-m max_sessions] [-q max_pending] [-b sendfile|mmap] [-f none|sequential|dropbehind] [-z stream_size] [-a cache_size] [-e cert -k key] [-x] [-w] [-g] [-c] [-h]"<<std::endl;
 	std::cout<<"- port: the port the server should listen on (default="<<DEFAULT_PORT<<")"<<std::endl;
 	std::cout<<"- rootdir: the http root from which files will be served (default="<<DEFAULT_ROOTDIR<<")"<<std::endl;
 	std::cout<<"- uid: if specified, servant will try to setuid() and setgid() to this value after binding to <port> (default=0"<<std::endl;
+	std::cout<<"- threads: how many worker threads handle sessions, split between the shards, 0 handles them on the network threads (default=number of cpus)"<<std::endl;
+	std::cout<<"- disk_threads: how many threads open, stat and read files for all the shards, 0 does it on the network threads (default="<<DEFAULT_DISK_THREADS<<")"<<std::endl;
+	std::cout<<"- shards: how many listeners share <port> (SO_REUSEPORT), each with its own thread and workers pinned to its own cpus, grouped by numa node (default="<<DEFAULT_SHARDS<<")"<<std::endl;
+	std::cout<<"- io: epoll waits for sockets to be ready, uring batches socket and file i/o through io_uring (linux only, sessions are handled on the shard threads) (default=epoll)"<<std::endl;
+	std::cout<<"- max_sessions: how many sessions each shard serves at once, 0 for no limit (default="<<DEFAULT_MAX_SESSIONS<<")"<<std::endl;
+	std::cout<<"- max_pending: how many more connections each shard holds on to until a session ends, the rest get a 503 (default="<<DEFAULT_MAX_PENDING<<")"<<std::endl;
+	std::cout<<"- body: sendfile sends files from the page cache, mmap shares one mapping of each file between everyone serving it (default=sendfile)"<<std::endl;
+	std::cout<<"- stream: what's done about the page cache for big files, sequential reads them ahead of the socket, dropbehind also drops what's been sent so smaller hot files stay cached (default=sequential)"<<std::endl;
+	std::cout<<"- stream_size: files at least this many bytes are streamed, audio and video from "<<RESOURCE_READAHEAD<<" bytes (default="<<DEFAULT_STREAM_SIZE<<")"<<std::endl;
+	std::cout<<"- cache_size: bytes of small files (up to "<<CACHE_MAX_FILE<<" bytes each) kept in memory, least recently used go first, 0 for none (default="<<DEFAULT_CACHE_SIZE<<")"<<std::endl;
+	std::cout<<"- cert, key: serve https on <port> with this certificate chain and private key (pem files, the key defaults to the certificate's file), with kernel tls where available so sendfile still works (epoll only)"<<std::endl;
+	std::cout<<"- x: index the document root at startup, indexed files are served without looking for them on disk, so changes to them aren't seen without -w (files added since are still found)"<<std::endl;
+	std::cout<<"- w: watch the document root for changes (linux only), the index and the caches are brought up to date within moments instead of files being checked on every request"<<std::endl;
+	std::cout<<"- g: at startup, write gzip and brotli variants (\"style.css.gz\", \"style.css.br\") next to text files that don't have up to date ones, in the background. variants are sent to clients that accept them whether servant made them or not"<<std::endl;
+	std::cout<<"- c: with more than one shard, prefer handing connections to the shard on the cpu that received them (SO_INCOMING_CPU, linux only)"<<std::endl;
 
 	exit(EXIT_SUCCESS);
 }
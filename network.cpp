@@ -9,8 +9,22 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ifaddrs.h>
+#include <sys/uio.h>
 #endif
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#elif defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef SERVANT_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif // SERVANT_TLS
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -81,12 +95,56 @@ std::string net::me(){
 	return hostname == "" ? "[undetermined]" : hostname;
 }
 
+// TLS
+// certificate chain <cert> and private key <key>, both pem files
+net::tls_context::tls_context(const std::string &cert,const std::string &key){
+#ifdef SERVANT_TLS
+	ctx=SSL_CTX_new(TLS_server_method());
+	if(ctx==NULL)
+		return;
+
+	SSL_CTX_set_min_proto_version(ctx,TLS1_2_VERSION);
+	// let openssl hand the records to the kernel after the handshake where it can (TCP_ULP tls)
+	SSL_CTX_set_options(ctx,SSL_OP_ENABLE_KTLS|SSL_OP_NO_RENEGOTIATION);
+	// sends are retried from wherever the session left off, with whatever fits
+	SSL_CTX_set_mode(ctx,SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	// resumption skips the expensive part of the handshake: one ticket per connection,
+	// and the session cache for tls 1.2 clients that don't do tickets
+	SSL_CTX_set_session_cache_mode(ctx,SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(ctx,(const unsigned char*)"servant",7);
+	SSL_CTX_set_num_tickets(ctx,1);
+	SSL_CTX_set_timeout(ctx,TLS_SESSION_LIFETIME);
+
+	if(SSL_CTX_use_certificate_chain_file(ctx,cert.c_str())!=1||
+		SSL_CTX_use_PrivateKey_file(ctx,key.c_str(),SSL_FILETYPE_PEM)!=1||
+		SSL_CTX_check_private_key(ctx)!=1){
+		SSL_CTX_free(ctx);
+		ctx=NULL;
+	}
+#else
+	ctx=NULL;
+#endif // SERVANT_TLS
+}
+
+net::tls_context::~tls_context(){
+#ifdef SERVANT_TLS
+	if(ctx!=NULL)
+		SSL_CTX_free(ctx);
+#endif // SERVANT_TLS
+}
+
+bool net::tls_context::operator!()const{
+	return ctx==NULL;
+}
+
+// TCP SERVER
 net::tcp_server::tcp_server(){
 	scan = -1;
 }
 
-net::tcp_server::tcp_server(unsigned short port){
-	bind(port);
+net::tcp_server::tcp_server(unsigned short port,bool reuseport){
+	bind(port,reuseport);
 }
 
 net::tcp_server::~tcp_server(){
@@ -98,31 +156,47 @@ net::tcp_server::operator bool()const{
 	return scan!=-1;
 }
 
-// implements a timeout of <millis> milliseconds
-int net::tcp_server::accept(int millis){
+// accept a pending connection into <peer>, already non blocking
+// false when there are no more (or on error), call it until then to drain the backlog
+bool net::tcp_server::accept(tcp &peer){
 	if(scan == -1)
-		return -1;
-
-	sockaddr_in6 connector_addr;
-	socklen_t addr_len=sizeof(sockaddr_in6);
+		return false;
 
-	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = (long)millis * 1000;
+	sockaddr_storage addr;
+	socklen_t addr_len;
+	int sock;
+	for(;;){
+		addr_len=sizeof(addr);
+#ifdef SOCK_NONBLOCK
+		sock = accept4(scan, (sockaddr*)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		sock = ::accept(scan, (sockaddr*)&addr, &addr_len);
+#endif // SOCK_NONBLOCK
+		if(sock != -1)
+			break;
 
-	fd_set set;
-	FD_ZERO(&set);
-	FD_SET(scan, &set);
+		// the connection went away before it could be accepted, try the next one
+		const int err = get_errno();
+#ifdef _WIN32
+		if(err != WSAECONNRESET && err != WSAEINTR)
+			return false;
+#else
+		if(err != ECONNABORTED && err != EINTR)
+			return false;
+#endif // _WIN32
+	}
 
-	const int ret = select(scan + 1, &set, NULL, NULL, &timeout);
-	if(ret < 0)
-		return -1;
-	else if(ret == 0)
-		return -1;
-	else if(FD_ISSET(scan, &set))
-		return ::accept(scan, (sockaddr*)&connector_addr, &addr_len);
+#ifndef SOCK_NONBLOCK
+#ifdef _WIN32
+	// sockets inherit non blocking mode from the listening socket
+#else
+	fcntl(sock,F_SETFL,fcntl(sock,F_GETFL,0)|O_NONBLOCK);
+	fcntl(sock,F_SETFD,FD_CLOEXEC);
+#endif // _WIN32
+#endif // SOCK_NONBLOCK
 
-	return -1;
+	peer = tcp(sock, (sockaddr*)&addr, addr_len);
+	return true;
 }
 
 // cleanup
@@ -138,9 +212,10 @@ void net::tcp_server::close(){
 }
 
 // creates and binds a socket
+// with <reuseport>, several tcp_servers can bind the same port and the kernel spreads connections between them
 // true on success
 // false on failure (most common cause for failure: someone else is already bound to <port>)
-bool net::tcp_server::bind(unsigned short port){
+bool net::tcp_server::bind(unsigned short port,bool reuseport){
 	sockaddr_in6 addr;
 	memset(&addr,0,sizeof(sockaddr_in6));
 	addr.sin6_family=AF_INET6;
@@ -170,6 +245,20 @@ bool net::tcp_server::bind(unsigned short port){
 	setsockopt(scan,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(int));
 #endif
 
+	if(reuseport){
+#ifdef SO_REUSEPORT
+		int enable=1;
+		if(setsockopt(scan,SOL_SOCKET,SO_REUSEPORT,&enable,sizeof(int))){
+			close();
+			return false;
+		}
+#else
+		// not supported here
+		close();
+		return false;
+#endif // SO_REUSEPORT
+	}
+
 	// bind this socket to <port>
 	if(-1==::bind(scan,(sockaddr*)&addr,sizeof(sockaddr_in6))){
 		close();
@@ -180,6 +269,22 @@ bool net::tcp_server::bind(unsigned short port){
 	return true;
 }
 
+// prefer handing this listener connections whose packets are processed on <cpu>
+// only a hint, and only among listeners sharing a port (see tcp_server::bind)
+bool net::tcp_server::incoming_cpu(unsigned cpu){
+#ifdef SO_INCOMING_CPU
+	int value=cpu;
+	return setsockopt(scan,SOL_SOCKET,SO_INCOMING_CPU,&value,sizeof(int))==0;
+#else
+	return false;
+#endif // SO_INCOMING_CPU
+}
+
+// the listening socket
+int net::tcp_server::get_socket()const{
+	return scan;
+}
+
 /* ------------------------------------------- */
 /* ------------------------------------------- */
 /* ------------------------------------------- */
@@ -194,21 +299,28 @@ net::tcp::tcp(){
 // initialize with already opened socket
 net::tcp::tcp(int socket){
 	sock=socket;
+	tls=NULL;
+	ktls=false;
 	ai=NULL;
 	blocking=true;
+	peer_len=0;
 
 #ifdef _WIN32
 	u_long mode=0;
 	ioctlsocket(sock, FIONBIO, &mode);
 #endif // WIN32
+}
 
-	// figure out name
-	char n[51]="N/A";
-	sockaddr_in6 addr;
-	socklen_t len=sizeof(addr);
-	getpeername(sock,(sockaddr*)&addr,&len);
-	getnameinfo((sockaddr*)&addr,len,n,sizeof(n),NULL,0,NI_NUMERICHOST);
-	name=n;
+// initialize with an accepted non blocking socket connected to <addr>
+net::tcp::tcp(int socket,const sockaddr *addr,socklen_t len){
+	sock=socket;
+	tls=NULL;
+	ktls=false;
+	ai=NULL;
+	blocking=false;
+
+	memcpy(&peer,addr,len);
+	peer_len=len;
 }
 
 // regular constructor
@@ -223,12 +335,19 @@ net::tcp::tcp(const std::string &address,unsigned short port){
 // in a ownership handoff from <a> -> <b>, <a> cannot be used again.
 net::tcp::tcp(tcp &&rhs){
 	sock=rhs.sock;
+	tls=rhs.tls;
+	ktls=rhs.ktls;
 	name=rhs.name;
+	peer=rhs.peer;
+	peer_len=rhs.peer_len;
 	ai=rhs.ai;
 	blocking=rhs.blocking;
 
 	rhs.sock=-1;
+	rhs.tls=NULL;
+	rhs.ktls=false;
 	rhs.name="N/A";
+	rhs.peer_len=0;
 	rhs.ai=NULL;
 	rhs.blocking=true;
 }
@@ -242,12 +361,19 @@ net::tcp &net::tcp::operator=(net::tcp &&rhs){
 	this->close();
 
 	sock = rhs.sock;
+	tls = rhs.tls;
+	ktls = rhs.ktls;
 	name = rhs.name;
+	peer = rhs.peer;
+	peer_len = rhs.peer_len;
 	ai = rhs.ai;
 	blocking = rhs.blocking;
 
 	rhs.sock = -1;
+	rhs.tls = NULL;
+	rhs.ktls = false;
 	rhs.name = "N/A";
+	rhs.peer_len = 0;
 	rhs.ai = NULL;
 	rhs.blocking = true;
 
@@ -411,6 +537,9 @@ int net::tcp::send_nonblock(const void *buffer,unsigned size){
 
 	set_blocking(false);
 
+	if(tls!=NULL&&!ktls)
+		return tls_write(buffer,size);
+
 	int sent=::send(sock,(const char*)buffer,size,0);
 	if(sent==-1){
 #ifdef _WIN32
@@ -429,6 +558,65 @@ int net::tcp::send_nonblock(const void *buffer,unsigned size){
 	return sent;
 }
 
+// nonblocking send of <head> followed by <buffer>, gathered into one send
+// returns bytes sent from both, 0 if it would block
+int net::tcp::send_nonblock(const void *head,unsigned head_size,const void *buffer,unsigned size){
+	if(sock==-1)
+		return 0;
+
+	set_blocking(false);
+
+	// records encrypted out here can't be gathered, they go one after the other
+	if(tls!=NULL&&!ktls){
+		const int sent=tls_write(head,head_size);
+		if((unsigned)sent<head_size)
+			return sent;
+
+		return sent+tls_write(buffer,size);
+	}
+
+#ifdef _WIN32
+	WSABUF buffers[2];
+	buffers[0].buf=(char*)head;
+	buffers[0].len=head_size;
+	buffers[1].buf=(char*)buffer;
+	buffers[1].len=size;
+
+	DWORD bytes=0;
+	if(WSASend(sock,buffers,2,&bytes,0,NULL,NULL)==SOCKET_ERROR){
+		if(WSAGetLastError()==WSAEWOULDBLOCK)
+			return 0;
+
+		this->close(); // error
+		return 0;
+	}
+
+	return bytes;
+#else
+	iovec vec[2];
+	vec[0].iov_base=(void*)head;
+	vec[0].iov_len=head_size;
+	vec[1].iov_base=(void*)buffer;
+	vec[1].iov_len=size;
+
+	msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov=vec;
+	msg.msg_iovlen=2;
+
+	int sent=::sendmsg(sock,&msg,0);
+	if(sent==-1){
+		if(errno==EWOULDBLOCK) // acceptable, will happen a lot
+			return 0;
+
+		this->close(); // error
+		return 0;
+	}
+
+	return sent;
+#endif // _WIN32
+}
+
 // nonblocking recv
 int net::tcp::recv_nonblock(void *buffer,unsigned size){
 	if(sock==-1)
@@ -436,6 +624,9 @@ int net::tcp::recv_nonblock(void *buffer,unsigned size){
 
 	set_blocking(false);
 
+	if(tls!=NULL)
+		return tls_read(buffer,size);
+
 	int received=::recv(sock,(char*)buffer,size,0);
 	if(received==-1){
 #ifdef _WIN32
@@ -454,6 +645,164 @@ int net::tcp::recv_nonblock(void *buffer,unsigned size){
 	return received;
 }
 
+// nonblocking send of up to <size> bytes of file <fd> starting at <offset>
+// returns bytes sent, 0 if the socket isn't ready (or on socket error, see tcp::error)
+// -1 if the file couldn't be read
+int net::tcp::send_file_nonblock(int fd,long long offset,unsigned size){
+	if(sock==-1)
+		return 0;
+
+	set_blocking(false);
+
+#ifdef __linux__
+	// straight from the page cache to the socket, unless the tls records are made out here
+	if(tls==NULL||ktls){
+		off_t off=offset;
+		ssize_t sent;
+		do{
+			sent=sendfile(sock,fd,&off,size);
+		}while(sent==-1&&errno==EINTR);
+
+		if(sent==0)
+			return -1; // file is shorter than expected
+		if(sent==-1){
+			if(errno==EWOULDBLOCK) // acceptable, will happen a lot
+				return 0;
+
+			this->close(); // error
+			return 0;
+		}
+
+		return sent;
+	}
+#endif // __linux__
+
+	// no sendfile, go through a buffer
+	char block[16384];
+	if(size>sizeof(block))
+		size=sizeof(block);
+
+#ifdef _WIN32
+	if(_lseeki64(fd,offset,SEEK_SET)==-1)
+		return -1;
+	const int got=_read(fd,block,size);
+#else
+	const int got=pread(fd,block,size,offset);
+#endif // _WIN32
+	if(got<1)
+		return -1;
+
+	return send_nonblock(block,got);
+}
+
+// send <head>, then <size> bytes of file <fd> at <offset>
+// the head is held back (MSG_MORE) so it leaves in the same segment as the start of the file
+// returns bytes sent from both, 0 if it would block, -1 if the file ended before anything was sent
+int net::tcp::send_file_nonblock(const void *head,unsigned head_size,int fd,long long offset,unsigned size){
+	if(sock==-1)
+		return 0;
+
+	set_blocking(false);
+
+	int sent;
+	if(tls!=NULL&&!ktls){
+		sent=tls_write(head,head_size);
+	}
+	else{
+		int flags=0;
+#ifdef MSG_MORE
+		if(size>0)
+			flags=MSG_MORE;
+#endif // MSG_MORE
+
+		sent=::send(sock,(const char*)head,head_size,flags);
+		if(sent==-1){
+#ifdef _WIN32
+			if(WSAGetLastError()==WSAEWOULDBLOCK)
+#else
+			if(errno==EWOULDBLOCK) // acceptable, will happen a lot
+#endif // _WIN32
+				return 0;
+
+			this->close(); // error
+			return 0;
+		}
+	}
+
+	if((unsigned)sent<head_size||size==0)
+		return sent;
+
+	const int file=send_file_nonblock(fd,offset,size);
+	return file>0?sent+file:sent;
+}
+
+// talk tls over this (accepted) connection with the settings in <context>, see tcp::handshake
+bool net::tcp::start_tls(tls_context &context){
+#ifdef SERVANT_TLS
+	if(sock==-1||!context)
+		return false;
+
+	tls=SSL_new(context.ctx);
+	if(tls==NULL)
+		return false;
+
+	SSL_set_fd(tls,sock);
+	SSL_set_accept_state(tls);
+	return true;
+#else
+	return false;
+#endif // SERVANT_TLS
+}
+
+// carry on with the tls handshake
+// returns 1 once it's done (right away for plain tcp), 0 if it has to wait for the socket, -1 if it failed
+int net::tcp::handshake(){
+	if(sock==-1)
+		return -1;
+	if(tls==NULL)
+		return 1;
+
+#ifdef SERVANT_TLS
+	set_blocking(false);
+
+	ERR_clear_error();
+	const int result=SSL_do_handshake(tls);
+	if(result==1){
+		// with the records written by the kernel, sendfile works as usual
+#ifdef BIO_get_ktls_send
+		ktls=BIO_get_ktls_send(SSL_get_wbio(tls));
+#endif // BIO_get_ktls_send
+		return 1;
+	}
+
+	const int error=SSL_get_error(tls,result);
+	if(error==SSL_ERROR_WANT_READ||error==SSL_ERROR_WANT_WRITE)
+		return 0;
+#endif // SERVANT_TLS
+
+	this->close();
+	return -1;
+}
+
+// whether this connection talks tls
+bool net::tcp::secure()const{
+	return tls!=NULL;
+}
+
+// whether the kernel takes care of the tls records being sent
+bool net::tcp::kernel_tls()const{
+	return ktls;
+}
+
+// whether the tls handshake resumed an earlier session (from a ticket or the session cache)
+bool net::tcp::resumed()const{
+#ifdef SERVANT_TLS
+	return tls!=NULL&&SSL_session_reused(tls);
+#else
+	return false;
+#endif // SERVANT_TLS
+}
+
 // check how many bytes are available on the socket
 unsigned net::tcp::peek(){
 	if(sock==-1)
@@ -481,10 +830,28 @@ bool net::tcp::error()const{
 }
 
 // getter for socket name
+// sockets that were handed in are named the first time it's asked for
 const std::string &net::tcp::get_name()const{
+	if(name.empty()){
+		char n[51]="N/A";
+		if(peer_len==0){
+			peer_len=sizeof(peer);
+			if(getpeername(sock,(sockaddr*)&peer,&peer_len))
+				peer_len=0;
+		}
+		if(peer_len!=0)
+			getnameinfo((sockaddr*)&peer,peer_len,n,sizeof(n),NULL,0,NI_NUMERICHOST);
+		name=n;
+	}
+
 	return name;
 }
 
+// the underlying socket
+int net::tcp::get_socket()const{
+	return sock;
+}
+
 int net::tcp::release(){
 	int temp = sock;
 	sock = -1;
@@ -496,6 +863,17 @@ int net::tcp::release(){
 
 // cleanup
 void net::tcp::close(){
+#ifdef SERVANT_TLS
+	if(tls!=NULL){
+		// say goodbye if the socket is still there, without waiting for the peer's
+		if(sock!=-1&&SSL_is_init_finished(tls))
+			SSL_shutdown(tls);
+		SSL_free(tls);
+		tls=NULL;
+		ktls=false;
+	}
+#endif // SERVANT_TLS
+
 	if(sock!=-1){
 #ifdef _WIN32
 		::closesocket(sock);
@@ -539,11 +917,57 @@ void net::tcp::set_blocking(bool block){
 
 void net::tcp::init(){
 	sock=-1;
+	tls=NULL;
+	ktls=false;
 	name="N/A";
+	peer_len=0;
 	ai=NULL;
 	blocking=true;
 }
 
+// encrypt and send up to <size> bytes, returns bytes sent, 0 if the socket isn't ready (or on error, see tcp::error)
+int net::tcp::tls_write(const void *buffer,unsigned size){
+#ifdef SERVANT_TLS
+	if(size==0)
+		return 0;
+
+	ERR_clear_error();
+	const int sent=SSL_write(tls,buffer,size);
+	if(sent>0)
+		return sent;
+
+	const int error=SSL_get_error(tls,sent);
+	if(error==SSL_ERROR_WANT_WRITE||error==SSL_ERROR_WANT_READ)
+		return 0;
+
+	// the connection is broken, don't try to say goodbye
+	SSL_set_quiet_shutdown(tls,1);
+#endif // SERVANT_TLS
+
+	this->close();
+	return 0;
+}
+
+// receive and decrypt up to <size> bytes, returns bytes received, 0 if nothing is ready (or on error, see tcp::error)
+int net::tcp::tls_read(void *buffer,unsigned size){
+#ifdef SERVANT_TLS
+	ERR_clear_error();
+	const int received=SSL_read(tls,buffer,size);
+	if(received>0)
+		return received;
+
+	const int error=SSL_get_error(tls,received);
+	if(error==SSL_ERROR_WANT_READ||error==SSL_ERROR_WANT_WRITE)
+		return 0;
+
+	// the peer is gone (or said goodbye already)
+	SSL_set_quiet_shutdown(tls,1);
+#endif // SERVANT_TLS
+
+	this->close();
+	return 0;
+}
+
 bool net::tcp::writable(){
 	if(sock == -1)
 		return false;
@@ -15,6 +15,12 @@
 #include <netdb.h>
 #endif // WIN32
 
+// openssl, when built with tls (SERVANT_TLS)
+struct ssl_st;
+struct ssl_ctx_st;
+
+#define TLS_SESSION_LIFETIME 7200 // seconds a tls session can be resumed for
+
 namespace net{
 
 	std::string me();
@@ -28,17 +34,37 @@ namespace net{
 #endif // _WIN32
 
 // tcp
+class tcp;
+
+// server side tls settings shared by every connection: the certificate, and the keys for session tickets
+// operator! is true if it couldn't be set up, or servant was built without tls
+class tls_context{
+public:
+	tls_context(const std::string&,const std::string&);
+	tls_context(const tls_context&)=delete;
+	~tls_context();
+	tls_context &operator=(const tls_context&)=delete;
+	bool operator!()const;
+
+private:
+	friend class tcp;
+
+	ssl_ctx_st *ctx;
+};
+
 class tcp_server{
 public:
 	tcp_server();
-	tcp_server(unsigned short);
+	tcp_server(unsigned short,bool = false);
 	tcp_server(const tcp_server&)=delete;
 	~tcp_server();
 	tcp_server &operator=(const tcp_server&)=delete;
 	operator bool()const;
-	bool bind(unsigned short);
-	int accept(int = 0);
+	bool bind(unsigned short,bool = false);
+	bool accept(tcp&);
+	bool incoming_cpu(unsigned);
 	void close();
+	int get_socket()const;
 
 private:
 	int scan; // the socket for scanning
@@ -49,6 +75,7 @@ public:
 	tcp();
 	tcp(const std::string&,unsigned short);
 	tcp(int);
+	tcp(int,const sockaddr*,socklen_t);
 	tcp(const tcp&)=delete;
 	tcp(tcp&&);
 	~tcp();
@@ -61,20 +88,35 @@ public:
 	void send_block(const void*,unsigned);
 	void recv_block(void*,unsigned);
 	int send_nonblock(const void*,unsigned);
+	int send_nonblock(const void*,unsigned,const void*,unsigned);
 	int recv_nonblock(void*,unsigned);
+	int send_file_nonblock(int,long long,unsigned);
+	int send_file_nonblock(const void*,unsigned,int,long long,unsigned);
+	bool start_tls(tls_context&);
+	int handshake();
+	bool secure()const;
+	bool kernel_tls()const;
+	bool resumed()const;
 	unsigned peek();
 	void close();
 	bool error()const;
 	const std::string &get_name()const;
+	int get_socket()const;
 	int release();
 
 private:
 	void set_blocking(bool);
 	void init();
 	bool writable();
+	int tls_write(const void*,unsigned);
+	int tls_read(void*,unsigned);
 
 	int sock;
-	std::string name;
+	ssl_st *tls; // NULL for plain tcp
+	bool ktls; // the kernel writes the tls records (TCP_ULP tls), so the socket can be written to directly
+	mutable std::string name; // empty until tcp::get_name figures it out
+	mutable sockaddr_storage peer;
+	mutable socklen_t peer_len; // 0 if <peer> isn't known yet
 	addrinfo *ai;
 	bool blocking;
 };
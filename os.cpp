@@ -2,21 +2,35 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 #include <atomic>
 #include <thread>
 #include <limits.h>
 #include <stdlib.h>
-#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
 
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #else
+#include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
 #endif // _WIN32
 
+#include "os.h"
+
 extern std::atomic<bool> running;
 
 // change working dir
@@ -29,9 +43,7 @@ bool working_dir(const std::string &dir){
 }
 
 // get working dir
-static std::mutex working_dir_lock;
 bool get_working_dir(std::string &dir){
-	std::lock_guard<std::mutex> lock(working_dir_lock);
 	char path[512];
 #ifdef _WIN32
 	bool result=GetCurrentDirectory(sizeof(path), path)!=0;
@@ -52,10 +64,16 @@ bool get_working_dir(std::string &dir){
 #endif // _WIN32
 }
 
+static std::atomic<bool> graceful(false); // stopping because of SIGTERM, see graceful_shutdown
+#ifndef _WIN32
+static int shutdown_pipe[2]={-1,-1}; // written to by the signal handler, see shutdown_event
+#endif // _WIN32
+
 // signal handler
 #ifdef _WIN32
 BOOL WINAPI handler(DWORD sig){
 	if(sig==CTRL_C_EVENT){
+		graceful.store(false);
 		running.store(false);
 		return TRUE;
 	}
@@ -68,7 +86,13 @@ static void handler(int sig){
 	case SIGINT:
 	case SIGTERM:
 		std::cout<<std::endl;
+		// SIGINT also cuts a graceful shutdown short
+		graceful.store(sig==SIGTERM&&running.load());
 		running.store(false);
+		if(shutdown_pipe[1]!=-1){
+			const char b=0;
+			if(write(shutdown_pipe[1],&b,1)){}
+		}
 		break;
 	case SIGPIPE:
 		break;
@@ -80,6 +104,14 @@ void register_handlers(){
 #ifdef _WIN32
 	SetConsoleCtrlHandler(handler, TRUE);
 #else
+	// set up the pipe before anything can signal it
+	if(pipe(shutdown_pipe)==0){
+		for(int fd:shutdown_pipe){
+			fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,0)|O_NONBLOCK);
+			fcntl(fd,F_SETFD,FD_CLOEXEC);
+		}
+	}
+
 	// signal handlers
 	signal(SIGINT,handler);
 	signal(SIGTERM,handler);
@@ -87,6 +119,21 @@ void register_handlers(){
 #endif // _WIN32
 }
 
+// becomes readable (and stays that way) once the server has been asked to stop
+// -1 if there isn't one, the running flag has to be checked periodically then
+int shutdown_event(){
+#ifdef _WIN32
+	return -1;
+#else
+	return shutdown_pipe[0];
+#endif // _WIN32
+}
+
+// the server was asked to stop, but in-flight responses may finish first
+bool graceful_shutdown(){
+	return graceful.load();
+}
+
 // try to setuid and setgid to config::uid
 // only relevant for linux
 bool drop_root(unsigned uid){
@@ -107,9 +154,8 @@ bool drop_root(unsigned uid){
 
 // canonical path
 // return false if <target> doesn't exist
-std::mutex canon_path_lock;
+// safe to call from any thread
 bool canonical_path(const std::string &target,std::string &canon){
-	std::lock_guard<std::mutex> lock(canon_path_lock);
 #ifdef _WIN32
 	if(GetFileAttributes(target.c_str())==INVALID_FILE_ATTRIBUTES)
 		return false;
@@ -146,6 +192,80 @@ bool is_directory(const std::string &target){
 #endif // _WIN32
 }
 
+// write <size> bytes of <data> to <fname>, through a temporary file renamed over it so nobody sees it half written
+// the temporary file is next to it, with TEMP_FILE_PREFIX in front of its name
+bool replace_file(const std::string &fname,const char *data,long long size){
+	const size_t slash=fname.find_last_of("/\\");
+	const std::string temp=slash==std::string::npos?TEMP_FILE_PREFIX+fname:fname.substr(0,slash+1)+TEMP_FILE_PREFIX+fname.substr(slash+1);
+	FILE *f=fopen(temp.c_str(),"wb");
+	if(f==NULL)
+		return false;
+
+	const bool wrote=fwrite(data,1,size,f)==(size_t)size;
+	if(fclose(f)!=0||!wrote){
+		remove(temp.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	const bool renamed=MoveFileEx(temp.c_str(),fname.c_str(),MOVEFILE_REPLACE_EXISTING)!=0;
+#else
+	const bool renamed=rename(temp.c_str(),fname.c_str())==0;
+#endif // _WIN32
+	if(!renamed)
+		remove(temp.c_str());
+
+	return renamed;
+}
+
+// names of everything in directory <dir> except "." and ".."
+bool list_directory(const std::string &dir,std::vector<std::string> &names){
+#ifdef _WIN32
+	WIN32_FIND_DATA found;
+	HANDLE h=FindFirstFile((dir+"\\*").c_str(),&found);
+	if(h==INVALID_HANDLE_VALUE)
+		return false;
+
+	do{
+		if(strcmp(found.cFileName,".")&&strcmp(found.cFileName,".."))
+			names.push_back(found.cFileName);
+	}while(FindNextFile(h,&found));
+
+	FindClose(h);
+	return true;
+#else
+	DIR *d=opendir(dir.c_str());
+	if(d==NULL)
+		return false;
+
+	struct dirent *entry;
+	while((entry=readdir(d))!=NULL){
+		if(strcmp(entry->d_name,".")&&strcmp(entry->d_name,".."))
+			names.push_back(entry->d_name);
+	}
+
+	closedir(d);
+	return true;
+#endif // _WIN32
+}
+
+// false for directories, pipes, devices and anything else that isn't just bytes on disk
+bool is_regular_file(const std::string &target){
+#ifdef _WIN32
+	DWORD attributes=GetFileAttributes(target.c_str());
+	if(attributes == INVALID_FILE_ATTRIBUTES)
+		return false;
+
+	return (attributes&(FILE_ATTRIBUTE_DIRECTORY|FILE_ATTRIBUTE_DEVICE))==0;
+#else
+	struct stat s;
+	if(stat(target.c_str(),&s))
+		return false;
+
+	return S_ISREG(s.st_mode);
+#endif // _WIN32
+}
+
 long long filesize(const std::string &fname){
 #ifdef _WIN32
 	HANDLE h = CreateFile(fname.c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -165,3 +285,249 @@ long long filesize(const std::string &fname){
 	return s.st_size;
 #endif // _WIN32
 }
+
+// size and modification time of <fname>, for telling whether it changed
+// false if it doesn't exist
+bool file_stamp(const std::string &fname,long long &size,long long &mtime){
+#ifdef _WIN32
+	struct _stat64 s;
+	if(0 != _stat64(fname.c_str(), &s))
+		return false;
+
+	size = s.st_size;
+	mtime = s.st_mtime;
+	return true;
+#else
+	struct stat s;
+	if(0 != stat(fname.c_str(), &s))
+		return false;
+
+	size = s.st_size;
+#ifdef __linux__
+	mtime = s.st_mtim.tv_sec * 1000000000ll + s.st_mtim.tv_nsec;
+#else
+	mtime = s.st_mtime;
+#endif // __linux__
+	return true;
+#endif // _WIN32
+}
+
+// map <size> bytes of file <fd> read only, returns NULL on failure
+// the mapping stays valid after <fd> is closed
+const char *map_file(int fd,long long size){
+#ifdef _WIN32
+	HANDLE h=CreateFileMapping((HANDLE)_get_osfhandle(fd),NULL,PAGE_READONLY,0,0,NULL);
+	if(h==NULL)
+		return NULL;
+
+	const char *data=(const char*)MapViewOfFile(h,FILE_MAP_READ,0,0,size);
+	CloseHandle(h);
+	return data;
+#else
+	void *data=mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0);
+	return data==MAP_FAILED?NULL:(const char*)data;
+#endif // _WIN32
+}
+
+void unmap_file(const char *data,long long size){
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap((void*)data,size);
+#endif // _WIN32
+}
+
+// open a file for reading, returns -1 on failure
+int open_file(const std::string &fname){
+#ifdef _WIN32
+	return _open(fname.c_str(),_O_RDONLY|_O_BINARY);
+#else
+	return open(fname.c_str(),O_RDONLY|O_CLOEXEC);
+#endif // _WIN32
+}
+
+// open file <canon>, a canonical path (see canonical_path), like open_file, as long as it's still the file at that path
+// the path may go through a symlink by now, if the file or a directory on the way was replaced with one since it was resolved
+// returns -1 on failure, or if what got opened isn't at <canon>
+int open_canonical(const std::string &canon){
+#ifdef _WIN32
+	return open_file(canon); // canonical_path doesn't resolve links here
+#else
+	const int fd=open(canon.c_str(),O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+	if(fd==-1)
+		return -1;
+
+	// where the file that was opened really is
+	std::string opened;
+#ifdef __linux__
+	char link[64];
+	char path[PATH_MAX];
+	snprintf(link,sizeof(link),"/proc/self/fd/%d",fd);
+	const ssize_t len=readlink(link,path,sizeof(path));
+	if(len>0&&len<(ssize_t)sizeof(path))
+		opened.assign(path,len);
+	else if(!canonical_path(canon,opened)) // no /proc
+		opened.clear();
+#else
+	if(!canonical_path(canon,opened))
+		opened.clear();
+#endif // __linux__
+
+	if(opened!=canon){
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+#endif // _WIN32
+}
+
+// read up to <size> bytes at <offset> from a file opened with open_file
+// returns bytes read, 0 at end of file, -1 on error
+int read_file(int fd,char *buf,int size,long long offset){
+#ifdef _WIN32
+	if(_lseeki64(fd,offset,SEEK_SET)==-1)
+		return -1;
+
+	return _read(fd,buf,size);
+#else
+	ssize_t got;
+	do{
+		got=pread(fd,buf,size,offset);
+	}while(got==-1&&errno==EINTR);
+
+	return got;
+#endif // _WIN32
+}
+
+// tell the kernel how <len> bytes at <offset> of file <fd> will be used (FILE_ADVICE_*), 0 <len> for the rest of it
+// the hint is only advice, false if it couldn't be given
+bool advise_file(int fd,long long offset,long long len,int advice){
+#if defined(__linux__)
+	int hint;
+	switch(advice){
+	case FILE_ADVICE_SEQUENTIAL:
+		hint=POSIX_FADV_SEQUENTIAL;
+		break;
+	case FILE_ADVICE_NOREUSE:
+		hint=POSIX_FADV_NOREUSE;
+		break;
+	case FILE_ADVICE_WILLNEED:
+		hint=POSIX_FADV_WILLNEED;
+		break;
+	case FILE_ADVICE_DONTNEED:
+		hint=POSIX_FADV_DONTNEED;
+		break;
+	default:
+		return false;
+	}
+
+	return posix_fadvise(fd,offset,len,hint)==0;
+#else
+	return false;
+#endif // __linux__
+}
+
+void close_file(int fd){
+#ifdef _WIN32
+	_close(fd);
+#else
+	close(fd);
+#endif // _WIN32
+}
+
+// number of cpus, at least 1
+unsigned cpu_count(){
+	const unsigned count=std::thread::hardware_concurrency();
+	return count==0?1:count;
+}
+
+#ifdef __linux__
+// parse a sysfs cpu or node list (e.g. "0-3,8-11") into <list>
+static void parse_list(const char *path,std::vector<unsigned> &list){
+	FILE *file=fopen(path,"r");
+	if(file==NULL)
+		return;
+
+	unsigned first,last;
+	while(fscanf(file,"%u",&first)==1){
+		last=first;
+		int c=fgetc(file);
+		if(c=='-'){
+			if(fscanf(file,"%u",&last)!=1)
+				break;
+			c=fgetc(file);
+		}
+
+		for(unsigned i=first;i<=last;++i)
+			list.push_back(i);
+
+		if(c!=',')
+			break;
+	}
+
+	fclose(file);
+}
+#endif // __linux__
+
+// the cpus this process may run on, cpus on the same numa node are next to each other
+std::vector<unsigned> cpu_list(){
+	std::vector<unsigned> cpus;
+
+#ifdef __linux__
+	cpu_set_t allowed;
+	if(sched_getaffinity(0,sizeof(allowed),&allowed)==0){
+		// walk the nodes in order, collecting their cpus
+		std::vector<unsigned> nodes;
+		parse_list("/sys/devices/system/node/possible",nodes);
+		for(unsigned node:nodes){
+			char path[64];
+			sprintf(path,"/sys/devices/system/node/node%u/cpulist",node);
+
+			std::vector<unsigned> node_cpus;
+			parse_list(path,node_cpus);
+			for(unsigned cpu:node_cpus){
+				if(cpu<CPU_SETSIZE&&CPU_ISSET(cpu,&allowed)){
+					cpus.push_back(cpu);
+					CPU_CLR(cpu,&allowed);
+				}
+			}
+		}
+
+		// no numa information
+		for(unsigned cpu=0;cpu<CPU_SETSIZE;++cpu){
+			if(CPU_ISSET(cpu,&allowed))
+				cpus.push_back(cpu);
+		}
+	}
+#endif // __linux__
+
+	if(cpus.empty()){
+		for(unsigned i=0;i<cpu_count();++i)
+			cpus.push_back(i);
+	}
+
+	return cpus;
+}
+
+// restrict the calling thread to run only on <cpus>
+bool pin_thread(const std::vector<unsigned> &cpus){
+#ifdef _WIN32
+	DWORD_PTR mask=0;
+	for(unsigned cpu:cpus){
+		if(cpu<sizeof(mask)*8)
+			mask|=(DWORD_PTR)1<<cpu;
+	}
+
+	return mask!=0&&SetThreadAffinityMask(GetCurrentThread(),mask)!=0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(unsigned cpu:cpus){
+		if(cpu<CPU_SETSIZE)
+			CPU_SET(cpu,&set);
+	}
+
+	return pthread_setaffinity_np(pthread_self(),sizeof(set),&set)==0;
+#endif // _WIN32
+}
@@ -3,12 +3,36 @@
 
 // contains os specific functions
 
+// hints for advise_file about how a file's pages will be used
+#define FILE_ADVICE_SEQUENTIAL 1 // read front to back, read ahead more aggressively
+#define FILE_ADVICE_NOREUSE 2 // read once
+#define FILE_ADVICE_WILLNEED 3 // start reading it in now
+#define FILE_ADVICE_DONTNEED 4 // drop it from the page cache
+
+#define TEMP_FILE_PREFIX ".servant-" // replace_file writes "dir/file" as "dir/.servant-file" first
+
 bool working_dir(const std::string&);
 bool get_working_dir(std::string&);
 void register_handlers();
+int shutdown_event();
+bool graceful_shutdown();
 bool drop_root(unsigned);
 bool canonical_path(const std::string&,std::string&);
 bool is_directory(const std::string&);
+bool is_regular_file(const std::string&);
+bool list_directory(const std::string&,std::vector<std::string>&);
+bool replace_file(const std::string&,const char*,long long);
 long long filesize(const std::string&);
+bool file_stamp(const std::string&,long long&,long long&);
+const char *map_file(int,long long);
+void unmap_file(const char*,long long);
+int open_file(const std::string&);
+int open_canonical(const std::string&);
+int read_file(int,char*,int,long long);
+bool advise_file(int,long long,long long,int);
+void close_file(int);
+unsigned cpu_count();
+std::vector<unsigned> cpu_list();
+bool pin_thread(const std::vector<unsigned>&);
 
 #endif // OS_H
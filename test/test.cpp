@@ -1,5 +1,6 @@
 #include <iostream>
 #include <atomic>
+#include <filesystem>
 
 #define private public // nice
 #include "../Servant.h"
@@ -54,8 +55,289 @@ bool http_validate_test(){
 	return success;
 }
 
+// <ranges> as "first-last,first-last"
+std::string range_string(const std::vector<byte_range> &ranges){
+	std::string str;
+	for(const byte_range &r:ranges){
+		if(!str.empty())
+			str+=",";
+		str+=std::to_string(r.first)+"-"+std::to_string(r.last);
+	}
+
+	return str;
+}
+
+bool header_test(){
+	bool success=true;
+
+	struct field{
+		const char *const request;
+		const char *const name;
+		const bool found; // is the field supposed to be there
+		const char *const value;
+	};
+
+	// test cases
+	field cases[]={
+		{"GET / HTTP/1.1\r\nHost: example.com\r\n\r\n","host",true,"example.com"},
+		{"GET / HTTP/1.1\r\nHost: example.com\r\nRANGE:\t bytes=0-1 \t\r\n\r\n","range",true,"bytes=0-1"},
+		{"GET / HTTP/1.1\r\nRange:\r\n\r\n","range",true,""},
+		{"GET / HTTP/1.1\r\nHost: example.com\r\n\r\n","range",false,""},
+		{"GET / HTTP/1.1\r\nX-Range: bytes=0-1\r\nRanges: bytes=0-1\r\n\r\n","range",false,""},
+		{"GET /range: HTTP/1.1\r\n\r\n","range",false,""},
+		{"GET / HTTP/1.1\r\n\r\nRange: bytes=0-1\r\n\r\n","range",false,""}
+	};
+
+	for(int i=0;i<sizeof(cases)/sizeof(field);++i){
+		std::string value;
+		const bool found=Session::get_header(cases[i].request,cases[i].name,value);
+
+		if(found!=cases[i].found||(found&&value!=cases[i].value)){
+			std::cout<<RED_TEXT<<"header test "<<i<<" failed\n\""<<(found?value:"(not found)")<<"\""<<RESET_TEXT<<std::endl;
+			success=false;
+		}
+		else
+			std::cout<<GREEN_TEXT<<"header test "<<i<<" passed: "<<(found?"\""+value+"\"":"(not found)")<<RESET_TEXT<<std::endl;
+	}
+
+	return success;
+}
+
+bool range_test(){
+	bool success=true;
+
+	struct range{
+		std::string spec; // the Range field, none if empty
+		long long size; // of the resource
+		bool satisfiable; // false for a 416
+		std::string ranges; // what's supposed to be sent, see range_string
+	};
+
+	// more ranges than are honored, apart and overlapping
+	std::string apart="bytes=",overlapping="bytes=";
+	for(int i=0;i<=SESSION_MAX_RANGES;++i){
+		apart+=(i>0?",":"")+std::to_string(i*10)+"-"+std::to_string(i*10+4);
+		overlapping+=(i>0?",":"")+std::to_string(i*10)+"-"+std::to_string(i*10+14);
+	}
+
+	// test cases
+	range cases[]={
+		{"",1000,true,""},
+		{"bytes=0-99",1000,true,"0-99"},
+		{"bytes=-100",1000,true,"900-999"},
+		{"bytes=-2000",1000,true,"0-999"},
+		{"bytes=900-",1000,true,"900-999"},
+		{"bytes=0-1999",1000,true,"0-999"},
+		{"bytes=0-99,50-149",1000,true,"0-149"},
+		{"bytes=100-199,0-99",1000,true,"0-199"},
+		{"bytes=500-599,0-9",1000,true,"0-9,500-599"},
+		{"bytes= 0-9 , ,20-29",1000,true,"0-9,20-29"},
+		{"bytes=1000-,0-9",1000,true,"0-9"},
+		{"bytes=1000-",1000,false,""},
+		{"bytes=-0",1000,false,""},
+		{"bytes=1000-1099,2000-",1000,false,""},
+		{"bytes=0-",0,false,""},
+		{"bytes=abc",1000,true,""},
+		{"bytes=9-0",1000,true,""},
+		{"bytes=-",1000,true,""},
+		{"bytes=0-9,1-2-3",1000,true,""},
+		{"bytes=0-99999999999999999999",1000,true,""},
+		{"items=0-9",1000,true,""},
+		{apart,1000,true,""},
+		{overlapping,1000,true,"0-"+std::to_string(SESSION_MAX_RANGES*10+14)}
+	};
+
+	for(int i=0;i<sizeof(cases)/sizeof(range);++i){
+		const std::string request="GET / HTTP/1.1\r\n"+(cases[i].spec.empty()?"":"Range: "+cases[i].spec+"\r\n")+"\r\n";
+
+		std::vector<byte_range> ranges;
+		const bool satisfiable=Session::get_ranges(request,cases[i].size,ranges);
+		const std::string got=satisfiable?range_string(ranges):"(416)";
+
+		if(satisfiable!=cases[i].satisfiable||got!=(satisfiable?cases[i].ranges:"(416)")){
+			std::cout<<RED_TEXT<<"range test "<<i<<" failed\n\""<<got<<"\""<<RESET_TEXT<<std::endl;
+			success=false;
+		}
+		else
+			std::cout<<GREEN_TEXT<<"range test "<<i<<" passed: "<<(got.empty()?"(whole file)":got)<<RESET_TEXT<<std::endl;
+	}
+
+	return success;
+}
+
+bool encoding_test(){
+	bool success=true;
+
+	struct accept{
+		const char *const field; // Accept-Encoding, none if NULL
+		const int encodings; // ENCODING_* bits it's supposed to allow
+	};
+
+	const int gzip=ENCODING_GZIP,br=ENCODING_BROTLI;
+
+	// test cases
+	accept cases[]={
+		{NULL,0},
+		{"",0},
+		{"gzip",gzip},
+		{"br",br},
+		{"gzip, deflate, br",gzip|br},
+		{"x-gzip",gzip},
+		{"GZIP, Br",gzip|br},
+		{" gzip ;  q=0.5 ,br ; q=1 ",gzip|br},
+		{",,gzip,,",gzip},
+		{"gzip;q=0",0},
+		{"gzip;q=0.000, br",br},
+		{"br;Q=0, gzip",gzip},
+		{"gzip;level=1;q=0",0},
+		{"*",gzip|br},
+		{"*;q=0",0},
+		{"gzip;q=0, *",br},
+		{"*, br;q=0",gzip},
+		{"identity, deflate",0}
+	};
+
+	for(int i=0;i<sizeof(cases)/sizeof(accept);++i){
+		const std::string request=std::string("GET / HTTP/1.1\r\n")+(cases[i].field==NULL?"":std::string("Accept-Encoding: ")+cases[i].field+"\r\n")+"\r\n";
+
+		// like Session::respond
+		std::string value;
+		int encodings=0;
+		if(Session::get_header(request,"accept-encoding",value))
+			encodings=Session::get_encodings(value);
+
+		const std::string got=std::string(encodings&gzip?"gzip ":"")+(encodings&br?"br ":"")+(encodings&~(gzip|br)?"other ":"");
+		if(encodings!=cases[i].encodings){
+			std::cout<<RED_TEXT<<"encoding test "<<i<<" failed\n\""<<got<<"\""<<RESET_TEXT<<std::endl;
+			success=false;
+		}
+		else
+			std::cout<<GREEN_TEXT<<"encoding test "<<i<<" passed: "<<(got.empty()?"(none)":got)<<RESET_TEXT<<std::endl;
+	}
+
+	return success;
+}
+
+bool cache_test(){
+	bool success=true;
+
+	struct lookup{
+		const char *const type; // asked for
+		const int encoding;
+		const bool hit; // is the cached entry supposed to be found
+	};
+
+	// test cases, the file is cached as a gzip variant of "text/css"
+	lookup cases[]={
+		{"text/css",ENCODING_GZIP,true},
+		{"text/css",0,false},
+		{"text/css",ENCODING_BROTLI,false},
+		{"application/octet-stream",ENCODING_GZIP,false},
+		{"application/octet-stream",0,false}
+	};
+
+	Cache cache(1<<20);
+	for(int i=0;i<sizeof(cases)/sizeof(lookup);++i){
+		// a miss evicts it, so it goes back in every time
+		std::shared_ptr<cached_file> entry=std::make_shared<cached_file>();
+		entry->response="HTTP/1.1 200 OK\r\n\r\nbody{}";
+		entry->header_length=entry->response.length()-6;
+		entry->size=6;
+		entry->mtime=1;
+		entry->type="text/css";
+		entry->encoding=ENCODING_GZIP;
+		cache.insert("/www/style.css",entry);
+
+		const bool hit=cache.find("/www/style.css",6,1,cases[i].type,cases[i].encoding,false)!=NULL;
+		const std::string got=std::string(cases[i].type)+(cases[i].encoding?" encoded":"")+(hit?" (hit)":" (miss)");
+		if(hit!=cases[i].hit){
+			std::cout<<RED_TEXT<<"cache test "<<i<<" failed\n\""<<got<<"\""<<RESET_TEXT<<std::endl;
+			success=false;
+		}
+		else
+			std::cout<<GREEN_TEXT<<"cache test "<<i<<" passed: "<<got<<RESET_TEXT<<std::endl;
+	}
+
+	return success;
+}
+
+// <rc>'s body, read the way it's sent
+std::string body(Resource &rc){
+	std::string str;
+	char block[1024];
+	for(int got;(got=rc.get(block,sizeof(block)))>0;)
+		str.append(block,got);
+
+	return str;
+}
+
+bool file_test(){
+	bool success=true;
+
+	// a document root of its own, indexed and watched
+	const std::filesystem::path dir=std::filesystem::temp_directory_path()/"servant_test";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directory(dir);
+	const std::string page(8000,'x');
+	if(!working_dir(dir.string())||!replace_file("page.html",page.data(),page.length())||!Resource::serve_current_dir()){
+		std::cout<<RED_TEXT<<"file test failed\n\"can't set up "<<dir.string()<<"\""<<RESET_TEXT<<std::endl;
+		return false;
+	}
+	Resource::index_files();
+	Resource::watching=true;
+
+	struct check{
+		std::string what;
+		bool passed;
+	};
+	std::vector<check> checks;
+	std::string canon;
+
+	// it got shorter than it was indexed at, and the watcher hasn't said so yet
+	replace_file("page.html","short",5);
+	{
+		Resource rc("page.html");
+		const std::string got=body(rc);
+		checks.push_back({"shrunk file read as \""+got.substr(0,16)+"\" ("+std::to_string(rc.size())+" bytes)",rc.size()==5&&got=="short"});
+	}
+
+	// files that were only written to keep the index and the checked paths, with their new sizes
+	replace_file("late.txt","late",4);
+	Resource late("late.txt");
+	Resource::changed({{"page.html",FILE_CHANGED}});
+	const indexed_file *indexed=Resource::index.load()->find("page.html");
+	checks.push_back({"changed file indexed at "+std::to_string(indexed?indexed->size:-1)+" bytes",indexed!=NULL&&indexed->size==5});
+	checks.push_back({"checked paths kept after a change",Resource::paths.find("late.txt",canon)});
+
+	// added files rebuild the index and forget the checked paths
+	Resource::changed({{"late.txt",FILE_ADDED}});
+	checks.push_back({"added file indexed",Resource::index.load()->find("late.txt")!=NULL});
+	checks.push_back({"checked paths forgotten after an add",!Resource::paths.find("late.txt",canon)});
+
+	for(int i=0;i<checks.size();++i){
+		if(!checks[i].passed){
+			std::cout<<RED_TEXT<<"file test "<<i<<" failed\n\""<<checks[i].what<<"\""<<RESET_TEXT<<std::endl;
+			success=false;
+		}
+		else
+			std::cout<<GREEN_TEXT<<"file test "<<i<<" passed: "<<checks[i].what<<RESET_TEXT<<std::endl;
+	}
+
+	Resource::watching=false;
+	Resource::index.store(NULL);
+	working_dir(dir.parent_path().string());
+	std::filesystem::remove_all(dir);
+
+	return success;
+}
+
 int main(){
 	bool success=http_validate_test();
+	success=header_test()&&success;
+	success=range_test()&&success;
+	success=encoding_test()&&success;
+	success=cache_test()&&success;
+	success=file_test()&&success;
 
 	return success?0:1;
 }